@@ -0,0 +1,48 @@
+#!/bin/sh
+# run colors(1) over synthetic images and report throughput
+#
+# usage: bench.sh [colors [ffgen]]
+# SIZES, KS and MODES can be overridden from the environment.
+
+COLORS=${1:-./colors}
+FFGEN=${2:-./bench/ffgen}
+SIZES=${SIZES:-"320x240 1280x720 1920x1080"}
+KS=${KS:-"8 16 32"}
+MODES=${MODES:-"default -h -p -r"}
+
+TMP=$(mktemp -d) || exit 1
+trap 'rm -rf "$TMP"' EXIT INT TERM
+
+# field of the single line JSON statistics printed by colors -v
+field() {
+	sed -n "s/.*\"$1\":\([0-9.]*\).*/\1/p" "$TMP/stats"
+}
+
+printf '%-8s %-9s %-7s %3s %9s %9s %5s %9s\n' \
+	image size mode k unique wall iters MPix/s
+for img in gradient noise photo flat; do
+	for size in $SIZES; do
+		f="$TMP/$img-$size.ff"
+		"$FFGEN" -s "$size" "$img" > "$f" || exit 1
+		for mode in $MODES; do
+			opt=$mode
+			[ "$mode" = default ] && opt=
+			[ "$mode" = -r ] && opt="-r -S 1"
+			for k in $KS; do
+				start=$(date +%s.%N)
+				"$COLORS" -v $opt -n "$k" < "$f" \
+					2>"$TMP/log" >/dev/null || exit 1
+				end=$(date +%s.%N)
+				grep '^{' "$TMP/log" > "$TMP/stats"
+				echo "$start $end $(field points) $(field unique) \
+$(field iterations)" | awk -v img="$img" -v size="$size" \
+				    -v mode="$mode" -v k="$k" '{
+					wall = $2 - $1
+					printf "%-8s %-9s %-7s %3d %9d %9.4f %5d %9.2f\n",
+					    img, size, mode, k, $4, wall, $5,
+					    $3 / 1e6 / wall
+				}'
+			done
+		done
+	done
+done
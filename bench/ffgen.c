@@ -0,0 +1,190 @@
+/* See LICENSE file for copyright and license details. */
+#include <arpa/inet.h>
+
+#include <err.h>
+#include <errno.h>
+#include <math.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "../arg.h"
+#include "../util.h"
+
+/* synthetic farbfeld images for benchmarking colors(1) */
+
+char *argv0;
+
+uint32_t width = 640;
+uint32_t height = 480;
+struct rng rng;
+
+void
+gradient(uint32_t x, uint32_t y, uint16_t *px)
+{
+	px[0] = (uint64_t)x * 65535 / (width > 1 ? width - 1 : 1);
+	px[1] = (uint64_t)y * 65535 / (height > 1 ? height - 1 : 1);
+	px[2] = (uint64_t)(x + y) * 65535 / (width + height);
+}
+
+void
+noise(uint32_t x, uint32_t y, uint16_t *px)
+{
+	uint64_t r = rngnext(&rng);
+
+	px[0] = r;
+	px[1] = r >> 16;
+	px[2] = r >> 32;
+}
+
+/*
+ * a few smooth blobs of color over a soft background with some
+ * grain, which has the many near-duplicate colors of a photograph
+ */
+struct blob {
+	double x, y, r;
+	double rgb[3];
+} blobs[12];
+
+void
+photoinit(void)
+{
+	size_t i, j;
+
+	for (i = 0; i < sizeof(blobs) / sizeof(*blobs); i++) {
+		blobs[i].x = rnguniform(&rng, width);
+		blobs[i].y = rnguniform(&rng, height);
+		blobs[i].r = (width + height) / 8 +
+		             rnguniform(&rng, (width + height) / 4 + 1);
+		for (j = 0; j < 3; j++)
+			blobs[i].rgb[j] = rnguniform(&rng, 65536);
+	}
+}
+
+void
+photo(uint32_t x, uint32_t y, uint16_t *px)
+{
+	double w, sum = 1, acc[3];
+	size_t i, j;
+	int v;
+
+	/* background: a dim vertical gradient */
+	acc[0] = acc[1] = acc[2] = 8192 + 16384.0 * y / height;
+	for (i = 0; i < sizeof(blobs) / sizeof(*blobs); i++) {
+		w = hypot(x - blobs[i].x, y - blobs[i].y) / blobs[i].r;
+		w = exp(-w * w) * 4;
+		for (j = 0; j < 3; j++)
+			acc[j] += blobs[i].rgb[j] * w;
+		sum += w;
+	}
+	for (j = 0; j < 3; j++) {
+		v = acc[j] / sum + (int)rnguniform(&rng, 2049) - 1024;
+		px[j] = v < 0 ? 0 : v > 65535 ? 65535 : v;
+	}
+}
+
+/* flat art: a handful of colors in rectangles, like icons or UI */
+uint16_t flattab[6][3];
+
+void
+flatinit(void)
+{
+	size_t i, j;
+
+	for (i = 0; i < sizeof(flattab) / sizeof(*flattab); i++)
+		for (j = 0; j < 3; j++)
+			flattab[i][j] = rnguniform(&rng, 256) * 257;
+}
+
+void
+flat(uint32_t x, uint32_t y, uint16_t *px)
+{
+	size_t i;
+
+	i = (x * 3 / width + y * 2 / height * 3) % 6;
+	memcpy(px, flattab[i], sizeof(flattab[i]));
+}
+
+struct {
+	char *name;
+	void (*init)(void);
+	void (*pixel)(uint32_t, uint32_t, uint16_t *);
+} gens[] = {
+	{ "gradient", NULL,      gradient },
+	{ "noise",    NULL,      noise    },
+	{ "photo",    photoinit, photo    },
+	{ "flat",     flatinit,  flat     },
+};
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-S seed] [-s widthxheight] "
+	        "gradient | noise | photo | flat\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	uint32_t hdr[4], x, y;
+	uint16_t *row, *px;
+	uint64_t seed = 1;
+	size_t i, j;
+	char *e;
+
+	ARGBEGIN {
+	case 'S':
+		errno = 0;
+		seed = strtoull(EARGF(usage()), &e, 0);
+		if (*e || errno)
+			errx(1, "invalid seed");
+		break;
+	case 's':
+		errno = 0;
+		width = strtoul(EARGF(usage()), &e, 10);
+		if (*e++ != 'x')
+			errx(1, "invalid size");
+		height = strtoul(e, &e, 10);
+		if (*e || errno || !width || !height)
+			errx(1, "invalid size");
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc != 1)
+		usage();
+	for (i = 0; i < sizeof(gens) / sizeof(*gens); i++)
+		if (!strcmp(argv[0], gens[i].name))
+			break;
+	if (i == sizeof(gens) / sizeof(*gens))
+		usage();
+
+	rngseed(&rng, seed);
+	if (gens[i].init)
+		gens[i].init();
+
+	if (!(row = reallocarray(NULL, width, 4 * sizeof(*row))))
+		err(1, "reallocarray");
+	memcpy(hdr, "farbfeld", sizeof("farbfeld") - 1);
+	hdr[2] = htonl(width);
+	hdr[3] = htonl(height);
+	if (fwrite(hdr, sizeof(*hdr), 4, stdout) != 4)
+		err(1, "fwrite");
+	for (y = 0; y < height; y++) {
+		for (x = 0; x < width; x++) {
+			px = &row[x * 4];
+			gens[i].pixel(x, y, px);
+			px[3] = 65535;
+			for (j = 0; j < 4; j++)
+				px[j] = htons(px[j]);
+		}
+		if (fwrite(row, sizeof(*row), width * 4, stdout) != width * 4)
+			err(1, "fwrite");
+	}
+	if (fflush(stdout) == EOF)
+		err(1, "fflush");
+	return 0;
+}
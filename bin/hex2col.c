@@ -1,9 +1,17 @@
 /* See LICENSE file for copyright and license details. */
+#include <sys/ioctl.h>
+
+#include <err.h>
+#include <errno.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
 #include <unistd.h>
 #include <string.h>
 
+#include "../colors.h"
+#include "../util.h"
+
 /*
  * X.org 256 colors palette
  * http://www.calmar.ws/vim/256-xterm-24bit-rgb-color-chart.html
@@ -42,6 +50,8 @@ int map[256][3] = {
     { 88, 88, 88}, { 96, 96, 96}, {102,102,102}, {118,118,118}, {128,128,128}, {138,138,138}, {148,148,148}, {158,158,158}
 };
 
+struct lut lut;
+
 /*
  * takes a 24 bits colors as an argument, and return the nearest color from our
  * 256 X colors palette using the color quantization method.
@@ -50,19 +60,7 @@ int map[256][3] = {
 int
 quantization(int rgb[3])
 {
-	int i, tmp, index;
-	int distance = 442 * 442; /* it's always 442 somewhere */
-
-	for (i = 0, tmp = 0; i < 256; i++) {
-		tmp = (rgb[0] - map[i][0]) * (rgb[0] - map[i][0]) +
-		      (rgb[1] - map[i][1]) * (rgb[1] - map[i][1]) +
-		      (rgb[2] - map[i][2]) * (rgb[2] - map[i][2]);
-		if (tmp < distance) {
-			distance = tmp;
-			index = i;
-		}
-	}
-	return index;
+	return lutnearest(&lut, rgb);
 }
 
 /*
@@ -73,22 +71,165 @@ void
 hex2rgb(char *hex, int *rgb)
 {
 	int i;
-	char tmp[2];
+	char tmp[3] = { 0 };
 	for (i = 0; i < 3; i++) {
 		strncpy(tmp, hex + 1 + 2 * i, 2);
 		rgb[i] = strtol(tmp, NULL, 16);
 	}
 }
 
+/*
+ * Image preview: the picture is scaled down to fit the terminal with a box
+ * filter while it is being decoded, and every character cell shows two
+ * pixels stacked with the upper half block. The whole frame is built in
+ * memory and written out at once.
+ */
+struct preview {
+	struct parser pr;
+	uint32_t width, height;  /* of the image */
+	uint32_t cols, rows;     /* of the preview, in pixels */
+	uint64_t (*sum)[4];      /* r, g, b and count of every preview pixel */
+	int truemod;
+} pv;
+
+struct buf out;
+
+void
+preview_size(struct parser *pr, uint32_t width, uint32_t height)
+{
+	struct winsize ws;
+	uint32_t tcols = 80, tlines = 24;
+	double scale;
+	char *e;
+
+	if (ioctl(STDOUT_FILENO, TIOCGWINSZ, &ws) == 0 && ws.ws_col) {
+		tcols = ws.ws_col;
+		tlines = ws.ws_row;
+	} else {
+		if ((e = getenv("COLUMNS")) && atoi(e) > 0)
+			tcols = atoi(e);
+		if ((e = getenv("LINES")) && atoi(e) > 0)
+			tlines = atoi(e);
+	}
+	/* leave a line for the prompt */
+	if (tlines > 1)
+		tlines--;
+
+	scale = (double)width / tcols;
+	if ((double)height / (tlines * 2) > scale)
+		scale = (double)height / (tlines * 2);
+	if (scale < 1)
+		scale = 1;
+
+	pv.width = width;
+	pv.height = height;
+	pv.cols = width / scale ? width / scale : 1;
+	pv.rows = height / scale ? height / scale : 1;
+	pv.sum = calloc((size_t)pv.cols * pv.rows, sizeof(*pv.sum));
+	if (pv.sum == NULL)
+		err(1, "calloc");
+}
+
+/* transparent pixels are blended over black */
+void
+preview_row(struct parser *pr, uint32_t y, uint8_t *row)
+{
+	uint64_t (*sum)[4];
+	uint32_t x;
+
+	sum = &pv.sum[(uint64_t)y * pv.rows / pv.height * pv.cols];
+	for (x = 0; x < pv.width; x++, row += 4) {
+		uint64_t *s = sum[(uint64_t)x * pv.cols / pv.width];
+		s[0] += row[0] * row[3];
+		s[1] += row[1] * row[3];
+		s[2] += row[2] * row[3];
+		s[3] += 255;
+	}
+}
+
+void
+preview_pixel(uint32_t x, uint32_t y, int rgb[3])
+{
+	uint64_t *s = pv.sum[(uint64_t)y * pv.cols + x];
+	int i;
+
+	for (i = 0; i < 3; i++)
+		rgb[i] = s[3] ? s[i] / s[3] : 0;
+}
+
+void
+preview_render(void)
+{
+	int top[3], bot[3], fg = -1, bg = -1, tc, bc;
+	uint32_t x, y;
+
+	for (y = 0; y < pv.rows; y += 2) {
+		for (x = 0; x < pv.cols; x++) {
+			preview_pixel(x, y, top);
+			if (y + 1 < pv.rows)
+				preview_pixel(x, y + 1, bot);
+			else
+				bot[0] = bot[1] = bot[2] = 0;
+
+			if (pv.truemod) {
+				bufprintf(&out, "\033[38;2;%d;%d;%dm"
+				           "\033[48;2;%d;%d;%dm\u2580",
+				           top[0], top[1], top[2],
+				           bot[0], bot[1], bot[2]);
+				continue;
+			}
+			/* only switch colors when they change */
+			tc = quantization(top);
+			bc = quantization(bot);
+			if (tc != fg)
+				bufprintf(&out, "\033[38;5;%dm", tc);
+			if (bc != bg)
+				bufprintf(&out, "\033[48;5;%dm", bc);
+			bufprintf(&out, "\u2580");
+			fg = tc, bg = bc;
+		}
+		bufprintf(&out, "\033[0m\n");
+		fg = bg = -1;
+	}
+	if (bufflush(&out, STDOUT_FILENO) < 0)
+		err(1, "write");
+}
+
+void
+preview(int truemod)
+{
+	int c;
+
+	if ((c = getc(stdin)) == EOF || ungetc(c, stdin) == EOF)
+		exit(1);
+	pv.pr.size = preview_size;
+	pv.pr.row = preview_row;
+	pv.truemod = truemod;
+	(c == 'f' ? parseimg_ff : parseimg_png)(stdin, &pv.pr);
+	preview_render();
+}
+
 int
 main(int argc, char *argv[])
 {
 	char hex[8];
-	int rgb[3], color = 0, truemod = 0;
+	int rgb[3], color = 0, truemod = 0, imgmod = 0;
+
+	for (; argc > 1; argc--, argv++) {
+		/* use the "true-colors" ANSI escape (works only with Xterm) */
+		if (strncmp(argv[1], "-t", 2) == 0)
+			truemod = 1;
+		/* or show a whole PNG or farbfeld image read from stdin */
+		else if (strncmp(argv[1], "-i", 2) == 0)
+			imgmod = 1;
+	}
 
-	/* either use the "true-colors" ANSI escape (works only with Xterm) */
-	if (argc > 1 && strncmp(argv[1], "-t", 2) == 0)
-		truemod = 1;
+	lutinit(&lut, map, 256);
+
+	if (imgmod) {
+		preview(truemod);
+		return 0;
+	}
 
 	while (fgets(hex, 8, stdin)) {
 		if (hex[0] == '#') {
@@ -8,20 +8,25 @@
 /* magic to return the ratio between two numbers */
 #define RATIO(a,b) (((a)>(b) ? 1.0*(b)/(a) : ((a) > 0 ? 1.0*(a)/(b) : 0)))
 
-struct color_t {
-	char   hex[8];
-	int    rgb[3];
-	double val;
-	struct color_t *next;
+#define NMASKS 8
+
+/*
+ * the colors are kept as a structure of arrays, so that scoring a mask is
+ * one tight loop over each channel
+ */
+struct colors_t {
+	char  (*hex)[8];
+	int    *rgb[3];
+	double *val[NMASKS];  /* score of every color for each mask */
+	size_t  len;
+	size_t  cap;
 };
 
-struct color_t *head = NULL;
-struct color_t **sorted = NULL;
-struct color_t **messed = NULL;
+struct colors_t colors;
 
 void
 usage(char *argv0) {
-	fprintf(stderr, "usage: %s [mask]\n", argv0);
+	fprintf(stderr, "usage: %s [-a | -t] [mask]\n", argv0);
 }
 
 /*
@@ -32,42 +37,46 @@ void
 hex2rgb(char *hex, int *rgb)
 {
 	int i;
-	char tmp[2];
+	char tmp[3] = { 0 };
 	for (i = 0; i < 3; i++) {
 		strncpy(tmp, hex + 1 + 2 * i, 2);
 		rgb[i] = strtol(tmp, NULL, 16);
 	}
 }
 
-/*
- * Returns the "ratio" of the negative color for an RGB representation.
- *
- * For mask 4 (100)b which is red. It will return the purity ratio of its
- * negative color: cyan (#00ffff). For example:
- *
- * #ff2d2d  255,45,45  45/45 = 1.0 (this is a "full" cyan)
- * #ff3c1e  255,6°,30  60/30 = 0.5 (this is a "half" cyan)
- */
-double
-color_ratio(int *rgb, uint8_t mask)
+/* append a color to the arrays */
+int
+color_new(char *hex)
 {
-	switch(mask) {
-	case 4: return RATIO(rgb[1],rgb[2]);
-	case 2: return RATIO(rgb[0],rgb[2]);
-	case 1: return RATIO(rgb[0],rgb[1]);
-	case 3: return RATIO(rgb[1],rgb[2]);
-	case 5: return RATIO(rgb[0],rgb[2]);
-	case 6: return RATIO(rgb[0],rgb[1]);
+	void *new = NULL;
+	int i, rgb[3];
+
+	if (colors.len == colors.cap) {
+		colors.cap = colors.cap ? colors.cap * 2 : 1024;
+		if ((new = realloc(colors.hex, colors.cap * 8)) == NULL)
+			return -1;
+		colors.hex = new;
+		for (i = 0; i < 3; i++) {
+			new = realloc(colors.rgb[i], colors.cap * sizeof(int));
+			if (new == NULL)
+				return -1;
+			colors.rgb[i] = new;
+		}
 	}
+	strncpy(colors.hex[colors.len], hex, 8);
+	hex2rgb(hex, rgb);
+	for (i = 0; i < 3; i++)
+		colors.rgb[i][colors.len] = rgb[i];
+	colors.len++;
 	return 0;
 }
 
 /*
  * Calculate a score for the dominance of the color given by `mask` (3 bit
- * representation of the RGB color, eg: 101 is magenta).
- * This will calculate the score of the color regarding the mask, and return
- * this value for comparison with other colors. "pure" refers to the color
- * represented by the mask, "negative" refers to the opposite of this color.
+ * representation of the RGB color, eg: 101 is magenta) for all the colors.
+ * The scores are compared with each other to sort the colors. "pure" refers
+ * to the color represented by the mask, "negative" refers to the opposite of
+ * this color.
  *
  * We differentiate 3 types of masks:
  * + 100, 010, 001
@@ -78,106 +87,122 @@ color_ratio(int *rgb, uint8_t mask)
  * Second group will be the pure color multiplied by the pure ratio.
  * Last group is just a plain sum of all colors.
  *
- * (Check function color_ratio() for an explanation on the ratio)
+ * The ratio is the purity of a mixed color, eg. for mask 4 (100)b which is
+ * red, the ratio of its negative color cyan (#00ffff):
+ *
+ * #ff2d2d  255,45,45  45/45 = 1.0 (this is a "full" cyan)
+ * #ff3c1e  255,60,30  60/30 = 0.5 (this is a "half" cyan)
+ *
+ * Each group is one loop over the channel arrays.
  */
-double
-color_dominant(int *rgb, uint8_t mask)
+int
+color_score(uint8_t mask)
 {
-	double pure = 0, negative = 0, ratio = 0;
+	double *val, pure, negative;
+	size_t i;
+	int *c[3], j, n = 0;
 
-	int prgb[3];
-	int nrgb[3];
+	if ((val = malloc(colors.len * sizeof(double))) == NULL)
+		return -1;
 
-	/* get the score of the current value */
-	prgb[0] = rgb[0] * ((mask & 4)>>2);
-	prgb[1] = rgb[1] * ((mask & 2)>>1);
-	prgb[2] = rgb[2] * ((mask & 1)>>0);
+	/* the channels in the mask first, then the others */
+	for (j = 0; j < 3; j++)
+		if (mask & (4 >> j))
+			c[n++] = colors.rgb[j];
+	for (j = 0; j < 3; j++)
+		if (!(mask & (4 >> j)))
+			c[n++] = colors.rgb[j];
 
-	/* score of the negative value */
-	nrgb[0] = rgb[0] * (((mask ^ 4)>>2)&1);
-	nrgb[1] = rgb[1] * (((mask ^ 2)>>1)&1);
-	nrgb[2] = rgb[2] * (((mask ^ 1)>>0)&1);
-
-	/*
-	 * calculate the average of either pure or negative color depending on
-	 * the mask's value
-	 */
 	switch (mask) {
 	case 1:
 	case 2:
 	case 4:
-		pure     =  prgb[0] + prgb[1] + prgb[2];
-		negative = (nrgb[0] + nrgb[1] + nrgb[2])/2;
-		ratio    = 1 + negative * color_ratio(nrgb, mask);
-		return ((pure - negative) / ratio);
+		for (i = 0; i < colors.len; i++) {
+			pure     = c[0][i];
+			negative = (c[1][i] + c[2][i])/2;
+			val[i]   = (pure - negative) /
+			           (1 + negative * RATIO(c[1][i], c[2][i]));
+		}
+		break;
 	case 3:
 	case 5:
 	case 6:
-		pure     = (prgb[0] + prgb[1] + prgb[2])/2;
-		negative = nrgb[0] + nrgb[1] + nrgb[2];
-		ratio    = 1 + pure * color_ratio(prgb, mask);
-		return ((pure - negative) * ratio);
+		for (i = 0; i < colors.len; i++) {
+			pure     = (c[0][i] + c[1][i])/2;
+			negative = c[2][i];
+			val[i]   = (pure - negative) *
+			           (1 + pure * RATIO(c[0][i], c[1][i]));
+		}
+		break;
+	default:
+		/* every channel is pure for 111, negative for 000 */
+		for (i = 0; i < colors.len; i++) {
+			pure   = c[0][i] + c[1][i] + c[2][i];
+			val[i] = mask ? pure : 0 - pure;
+		}
 	}
-
-	pure     = prgb[0] + prgb[1] + prgb[2];
-	negative = nrgb[0] + nrgb[1] + nrgb[2];
-	return pure - negative;
+	colors.val[mask] = val;
+	return 0;
 }
 
-/* create a color node, and add it to the list */
-struct color_t *
-color_new(char *hex, uint8_t mask)
-{
-	struct color_t *new = NULL;
+double *cmpval = NULL;
 
-	new = malloc(sizeof(struct color_t));
-	if (new == NULL)
-		return NULL;
+/* highest score first, equal scores in input order */
+int
+color_cmp(const void *a, const void *b)
+{
+	size_t ia = *(const size_t *)a, ib = *(const size_t *)b;
 
-	strncpy(new->hex, hex, 8);
-	hex2rgb(hex, new->rgb);
-	new->val = color_dominant(new->rgb, mask);
-	return new;
+	if (cmpval[ia] != cmpval[ib])
+		return cmpval[ia] < cmpval[ib] ? 1 : -1;
+	return ia < ib ? -1 : ia > ib;
 }
 
 /*
- * Takes an unsorted list of colors as an argument, and sort it depending on
- * the mask value.
+ * Returns the indices of the colors sorted depending on the mask value.
  * The mask is a 3 bit representation of the RGB composition you want to use to
  * sort colors, eg mask 011 will return the brightess cyan first, and darkest
  * red last.
  */
-struct color_t *
-color_sort(struct color_t *cur, struct color_t *new, uint8_t mask)
+size_t *
+color_sort(uint8_t mask)
 {
-	if (cur == NULL) {
-		new->next = NULL;
-	} else {
-		if (new->val <= cur->val) {
-			cur->next = color_sort(cur->next, new, mask);
-			return cur;
-		} else {
-			new->next = cur;
-		}
-	}
-	return new;
+	size_t *order = NULL;
+	size_t i;
+
+	if ((order = malloc(colors.len * sizeof(size_t))) == NULL)
+		return NULL;
+	for (i = 0; i < colors.len; i++)
+		order[i] = i;
+	cmpval = colors.val[mask];
+	qsort(order, colors.len, sizeof(size_t), color_cmp);
+	return order;
 }
 
 /*
- * print the content of our list in the format:
- * <HEX>	<RGB>	<SCORE>
+ * print the colors in the given order (input order if NULL) in the format:
+ * [<MASK>	]<HEX>	<RGB>	<SCORE>
+ * with all the masks' scores if mask is -1
  */
 void
-color_print(struct color_t *node)
+color_print(size_t *order, int mask, int prefix)
 {
-	struct color_t *tmp = NULL;
-	for (tmp=node; tmp; tmp=tmp->next) {
-		printf("%s\t%d,%d,%d\t%f\n",
-				tmp->hex,
-				tmp->rgb[0],
-				tmp->rgb[1],
-				tmp->rgb[2],
-				tmp->val );
+	size_t i, n;
+	int m;
+
+	for (i = 0; i < colors.len; i++) {
+		n = order ? order[i] : i;
+		if (prefix)
+			printf("%d\t", mask);
+		printf("%s\t%d,%d,%d",
+				colors.hex[n],
+				colors.rgb[0][n],
+				colors.rgb[1][n],
+				colors.rgb[2][n]);
+		for (m = 0; m < NMASKS; m++)
+			if (mask == -1 || mask == m)
+				printf("\t%f", colors.val[m][n]);
+		printf("\n");
 	}
 }
 
@@ -186,20 +211,56 @@ main(int argc, char *argv[])
 {
 	char hex[8];
 	uint8_t mask = 7;
+	char *argv0 = argv[0];
+	int allmode = 0, tablemode = 0, m;
+	size_t *order;
 
 	/* print whitest by default */
-	if (argc > 1) {
+	for (; argc > 1; argc--, argv++) {
 		if (strncmp(argv[1], "-h", 2) == 0)
-			usage(argv[0]);
+			usage(argv0);
+		else if (strcmp(argv[1], "-a") == 0)
+			allmode = 1;
+		else if (strcmp(argv[1], "-t") == 0)
+			tablemode = 1;
 		else
-			mask = atoi(argv[1]);
+			mask = atoi(argv[1]) & (NMASKS - 1);
 	}
 
 	while (fgets(hex, 8, stdin)) {
 		if (hex[0] == '#') {
-			head = color_sort(head, color_new(hex, mask), mask);
+			if (color_new(hex) < 0) {
+				perror("realloc");
+				return 1;
+			}
+		}
+	}
+
+	for (m = 0; m < NMASKS; m++) {
+		if (!allmode && !tablemode && m != mask)
+			continue;
+		if (color_score(m) < 0) {
+			perror("malloc");
+			return 1;
+		}
+	}
+
+	/* one table in input order, with a score column per mask */
+	if (tablemode) {
+		color_print(NULL, -1, 0);
+		return 0;
+	}
+
+	/* every ordering, prefixed by its mask */
+	for (m = 0; m < NMASKS; m++) {
+		if (!allmode && m != mask)
+			continue;
+		if ((order = color_sort(m)) == NULL) {
+			perror("malloc");
+			return 1;
 		}
+		color_print(order, m, allmode);
+		free(order);
 	}
-	color_print(head);
 	return 0;
 }
@@ -1,48 +1,119 @@
 /* See LICENSE file for copyright and license details. */
+#include <sys/resource.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <sys/wait.h>
+
 #include <err.h>
 #include <errno.h>
+#include <fcntl.h>
 #include <limits.h>
+#include <math.h>
+#include <pthread.h>
+#include <signal.h>
+#include <stdint.h>
 #include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 #include "arg.h"
 #include "colors.h"
 #include "tree.h"
+#include "util.h"
 
 #define LEN(x) (sizeof (x) / sizeof *(x))
+#define MIN(a, b) ((a) < (b) ? (a) : (b))
+#define MAX(a, b) ((a) > (b) ? (a) : (b))
 
 struct point {
 	int x;
 	int y;
 	int z;
+	int ncolors; /* merged into it by the coreset, only set with -C */
 	long long freq;
-	struct cluster *c;
-	RB_ENTRY(point) e;
+};
+
+struct node {
+	struct point p;
+	RB_ENTRY(node) e;
 };
 
 struct cluster {
 	struct point center;
 	size_t nelems;
+	double variance; /* mean squared distance from the center */
 	struct {
 		long long nmembers;
 		long long x, y, z;
+		long long xx, yy, zz;
 	} tmp;
 };
 
+struct iter {
+	double assign;
+	double means;
+	size_t moved;
+};
+
+/*
+ * a single clustering of the point set, the points themselves are
+ * shared read-only between all of them
+ */
+struct kmeans {
+	struct cluster *clusters;
+	size_t nclusters;
+	int *member; /* index of the cluster of every point, -1 if none */
+	size_t niters;
+	struct iter *iters;
+	unsigned long long ndists;
+	double seeding;
+	struct rng rng;
+};
+
+/* a color of the bisection tree, split into child and child + 1 */
+struct split {
+	struct point center;
+	long long weight;
+	int child; /* -1 for a leaf */
+};
+
 char *argv0;
 
-struct cluster *clusters;
 size_t nclusters = 8;
-RB_HEAD(pointtree, point) pointhead;
+size_t maxclusters;
+size_t nrestarts = 1;
+size_t nthreads = 1; /* building the histogram */
+RB_HEAD(pointtree, node) pointhead;
+struct point *points;
 size_t npoints;
-size_t niters;
+size_t nfullpoints; /* before the reduction to a coreset */
+size_t coresize;
+int coreshift;
+double coretime;
+long long ntotal;
+long long freqscale = 1; /* frequency of a fully opaque pixel */
+int alphamin = 1;
+int decay; /* percent of the histogram carried over to the next frame */
+double ingesttime;
+char *outfile;
+char *maskfile;
+char *sockpath;
+char *label; /* name of the current image when there are several */
 
+int aflag;
+int bflag;
+int dflag;
 int eflag;
+int Fflag;
 int rflag;
+int sflag;
 int hflag;
 int pflag;
 int vflag;
+int wflag;
 
 int
 distance(struct point *p1, struct point *p2)
@@ -56,16 +127,36 @@ distance(struct point *p1, struct point *p2)
 }
 
 int
-pointcmp(struct point *p1, struct point *p2)
+nodecmp(struct node *n1, struct node *n2)
 {
 	unsigned int a, b;
 
-	a = p1->x << 16 | p1->y << 8 | p1->z;
-	b = p2->x << 16 | p2->y << 8 | p2->z;
+	a = n1->p.x << 16 | n1->p.y << 8 | n1->p.z;
+	b = n2->p.x << 16 | n2->p.y << 8 | n2->p.z;
 	return a - b;
 }
-RB_PROTOTYPE(pointtree, point, e, pointcmp)
-RB_GENERATE(pointtree, point, e, pointcmp)
+
+/* in the same order as the tree, for qsort */
+int
+pointcmp(const void *a, const void *b)
+{
+	const struct point *p1 = a, *p2 = b;
+	unsigned int k1, k2;
+
+	k1 = p1->x << 16 | p1->y << 8 | p1->z;
+	k2 = p2->x << 16 | p2->y << 8 | p2->z;
+	return k1 < k2 ? -1 : k1 > k2;
+}
+
+RB_PROTOTYPE(pointtree, node, e, nodecmp)
+RB_GENERATE(pointtree, node, e, nodecmp)
+
+/* weights and errors in whole pixels */
+long long
+pixels(long long w)
+{
+	return (w + freqscale / 2) / freqscale;
+}
 
 int
 isempty(struct cluster *c)
@@ -73,32 +164,57 @@ isempty(struct cluster *c)
 	return c->nelems == 0;
 }
 
+/*
+ * recompute the centers, the last time round the spread of every cluster
+ * is gathered in the same pass
+ */
 void
-adjmeans(struct cluster *c, size_t n)
+adjmeans(struct kmeans *km, int final)
 {
+	struct cluster *c = km->clusters;
 	struct point *p;
+	double n;
 	size_t i;
 
-	for (i = 0; i < n; i++) {
+	for (i = 0; i < km->nclusters; i++) {
 		c[i].tmp.nmembers = 0;
 		c[i].tmp.x = 0;
 		c[i].tmp.y = 0;
 		c[i].tmp.z = 0;
+		c[i].tmp.xx = 0;
+		c[i].tmp.yy = 0;
+		c[i].tmp.zz = 0;
+		c[i].variance = 0;
 	}
 
-	RB_FOREACH(p, pointtree, &pointhead) {
-		p->c->tmp.nmembers += p->freq;
-		p->c->tmp.x += p->x * p->freq;
-		p->c->tmp.y += p->y * p->freq;
-		p->c->tmp.z += p->z * p->freq;
+	for (i = 0; i < npoints; i++) {
+		p = &points[i];
+		c = &km->clusters[km->member[i]];
+		c->tmp.nmembers += p->freq;
+		c->tmp.x += p->x * p->freq;
+		c->tmp.y += p->y * p->freq;
+		c->tmp.z += p->z * p->freq;
+		if (!final)
+			continue;
+		c->tmp.xx += p->x * p->x * p->freq;
+		c->tmp.yy += p->y * p->y * p->freq;
+		c->tmp.zz += p->z * p->z * p->freq;
 	}
 
-	for (i = 0; i < n; i++) {
+	c = km->clusters;
+	for (i = 0; i < km->nclusters; i++) {
 		if (isempty(&c[i]))
 			continue;
 		c[i].center.x = c[i].tmp.x / c[i].tmp.nmembers;
 		c[i].center.y = c[i].tmp.y / c[i].tmp.nmembers;
 		c[i].center.z = c[i].tmp.z / c[i].tmp.nmembers;
+		if (!final)
+			continue;
+		n = c[i].tmp.nmembers;
+		c[i].variance =
+		    (c[i].tmp.xx - c[i].tmp.x * (c[i].tmp.x / n)) / n +
+		    (c[i].tmp.yy - c[i].tmp.y * (c[i].tmp.y / n)) / n +
+		    (c[i].tmp.zz - c[i].tmp.z * (c[i].tmp.z / n)) / n;
 	}
 }
 
@@ -114,13 +230,8 @@ initcluster_greyscale(struct cluster *c, int i)
 void
 initcluster_pixel(struct cluster *c, int i)
 {
-	struct point *p;
-
 	c->nelems = 0;
-	RB_FOREACH(p, pointtree, &pointhead)
-		if (i-- == 0)
-			break;
-	c->center = *p;
+	c->center = points[i];
 }
 
 struct hue {
@@ -171,215 +282,2186 @@ void (*initcluster)(struct cluster *c, int i);
 size_t initspace;
 
 void
-initclusters(struct cluster *c, size_t n)
+initclusters(struct kmeans *km, size_t n)
 {
 	size_t i, next;
 	size_t step = initspace / n;
+	double t = now();
 
-	clusters = malloc(sizeof(*clusters) * n);
-	if (!clusters)
+	/* leave room for the clusters split off during a sweep */
+	km->clusters = malloc(sizeof(*km->clusters) *
+	                      (maxclusters > n ? maxclusters : n));
+	if (!km->clusters)
 		err(1, "malloc");
+	km->nclusters = n;
 	for (i = 0; i < n; i++) {
-		next = rflag ? rand() % initspace : i * step;
-		initcluster(&clusters[i], next);
+		next = rflag ? rnguniform(&km->rng, initspace) : i * step;
+		initcluster(&km->clusters[i], next);
 	}
+
+	if (!(km->member = reallocarray(NULL, npoints, sizeof(*km->member))))
+		err(1, "reallocarray");
+	for (i = 0; i < npoints; i++)
+		km->member[i] = -1;
+	km->niters = 0;
+	km->iters = NULL;
+	km->ndists = 0;
+	km->seeding = now() - t;
 }
 
 void
-addmember(struct cluster *c, struct point *p)
+freeclusters(struct kmeans *km)
 {
-	c->nelems++;
-	p->c = c;
+	free(km->clusters);
+	free(km->member);
+	free(km->iters);
 }
 
-void
-delmember(struct cluster *c, struct point *p)
+/* move every point to its nearest center, for any number of clusters */
+size_t
+assignany(struct kmeans *km)
+{
+	struct cluster *c = km->clusters;
+	struct point *p;
+	int *dists, mind, mini, i;
+	size_t j, moved = 0;
+
+	dists = malloc(km->nclusters * sizeof(*dists));
+	if (!dists)
+		err(1, "malloc");
+	for (j = 0; j < npoints; j++) {
+		p = &points[j];
+		for (i = 0; i < km->nclusters; i++)
+			dists[i] = distance(p, &c[i].center);
+
+		/* find the cluster that is nearest to the point */
+		mind = dists[0];
+		mini = 0;
+		for (i = 1; i < km->nclusters; i++) {
+			if (mind > dists[i]) {
+				mind = dists[i];
+				mini = i;
+			}
+		}
+
+		if (km->member[j] == mini)
+			continue;
+
+		/* not done yet, move point to nearest cluster */
+		moved++;
+		if (km->member[j] != -1)
+			c[km->member[j]].nelems--;
+		c[mini].nelems++;
+		km->member[j] = mini;
+	}
+	free(dists);
+	return moved;
+}
+
+/*
+ * the same for a number of clusters known at compile time: the centers are
+ * kept as arrays per channel, which the compiler unrolls and vectorizes
+ * along with the search for the nearest one. Floats hold every distance
+ * exactly, they never exceed 3 * 255^2.
+ */
+#define MAXFIXED 32
+
+size_t
+assignfixed(struct kmeans *km, const int k)
+{
+	struct cluster *c = km->clusters;
+	struct point *p;
+	float cx[MAXFIXED], cy[MAXFIXED], cz[MAXFIXED], d[MAXFIXED];
+	float x, y, z, mind;
+	int mini, i;
+	size_t j, moved = 0;
+
+	for (i = 0; i < k; i++) {
+		cx[i] = c[i].center.x;
+		cy[i] = c[i].center.y;
+		cz[i] = c[i].center.z;
+	}
+	for (j = 0; j < npoints; j++) {
+		p = &points[j];
+		x = p->x, y = p->y, z = p->z;
+		for (i = 0; i < k; i++)
+			d[i] = (x - cx[i]) * (x - cx[i]) +
+			       (y - cy[i]) * (y - cy[i]) +
+			       (z - cz[i]) * (z - cz[i]);
+		/* the smallest distance first, then the first center at it */
+		mind = d[0];
+		for (i = 1; i < k; i++)
+			mind = d[i] < mind ? d[i] : mind;
+		for (mini = 0; d[mini] != mind; mini++)
+			;
+
+		if (km->member[j] == mini)
+			continue;
+		moved++;
+		if (km->member[j] != -1)
+			c[km->member[j]].nelems--;
+		c[mini].nelems++;
+		km->member[j] = mini;
+	}
+	return moved;
+}
+
+size_t
+assign8(struct kmeans *km)
 {
-	c->nelems--;
-	p->c = NULL;
+	return assignfixed(km, 8);
 }
 
-int
-ismember(struct cluster *c, struct point *p)
+size_t
+assign16(struct kmeans *km)
+{
+	return assignfixed(km, 16);
+}
+
+size_t
+assign32(struct kmeans *km)
 {
-	return p->c == c;
+	return assignfixed(km, 32);
 }
 
 void
-process(void)
+process(struct kmeans *km)
 {
-	struct point *p;
-	int *dists, mind, mini, i, done = 0;
+	struct iter *it;
+	size_t (*assign)(struct kmeans *);
+	size_t moved = 1;
+	double t;
 
-	dists = malloc(nclusters * sizeof(*dists));
-	if (!dists)
-		err(1, "malloc");
+	switch (km->nclusters) {
+	case 8:
+		assign = assign8;
+		break;
+	case 16:
+		assign = assign16;
+		break;
+	case 32:
+		assign = assign32;
+		break;
+	default:
+		assign = assignany;
+	}
 
-	while (!done) {
-		done = 1;
-		niters++;
-		RB_FOREACH(p, pointtree, &pointhead) {
-			for (i = 0; i < nclusters; i++)
-				dists[i] = distance(p, &clusters[i].center);
-
-			/* find the cluster that is nearest to the point */
-			mind = dists[0];
-			mini = 0;
-			for (i = 1; i < nclusters; i++) {
-				if (mind > dists[i]) {
-					mind = dists[i];
-					mini = i;
-				}
-			}
+	while (moved) {
+		km->iters = reallocarray(km->iters, km->niters + 1,
+		                         sizeof(*km->iters));
+		if (!km->iters)
+			err(1, "reallocarray");
+		it = &km->iters[km->niters++];
+		t = now();
+		moved = assign(km);
+		km->ndists += npoints * km->nclusters;
+		it->moved = moved;
+		it->assign = now() - t;
+		t = now();
+		adjmeans(km, !moved);
+		it->means = now() - t;
+	}
+}
+
+/* weighted sum of squared errors of cluster c, or of all of them */
+long long
+sse(struct kmeans *km, int c)
+{
+	long long s = 0;
+	size_t i;
+	int m;
+
+	for (i = 0; i < npoints; i++) {
+		m = km->member[i];
+		if (c == -1 || m == c)
+			s += distance(&points[i], &km->clusters[m].center) *
+			     points[i].freq;
+	}
+	return s;
+}
+
+/*
+ * warm start for the next k: split the cluster with the largest
+ * error by seeding a new cluster at its member farthest from the
+ * center, the members are redistributed by the next process()
+ */
+int
+splitcluster(struct kmeans *km)
+{
+	struct cluster *c = km->clusters;
+	struct point *far = NULL;
+	long long s, maxs = -1;
+	int d, maxd = -1, maxc = 0;
+	size_t i;
+
+	for (i = 0; i < km->nclusters; i++) {
+		if ((s = sse(km, i)) > maxs) {
+			maxs = s;
+			maxc = i;
+		}
+	}
+	for (i = 0; i < npoints; i++) {
+		if (km->member[i] != maxc)
+			continue;
+		if ((d = distance(&points[i], &c[maxc].center)) > maxd) {
+			maxd = d;
+			far = &points[i];
+		}
+	}
+	c[km->nclusters].nelems = 0;
+	c[km->nclusters].center = *far;
+	km->nclusters++;
+	return maxc;
+}
 
-			if (ismember(&clusters[mini], p))
+/*
+ * split the cluster with the largest error in two, only its own members
+ * are moved between the halves and every other cluster stays as it is
+ */
+int
+bisectcluster(struct kmeans *km)
+{
+	struct cluster *c = km->clusters;
+	size_t i, moved;
+	int a, b, m;
+
+	a = splitcluster(km);
+	b = km->nclusters - 1;
+	do {
+		moved = 0;
+		for (i = 0; i < npoints; i++) {
+			if (km->member[i] != a && km->member[i] != b)
+				continue;
+			m = distance(&points[i], &c[b].center) <
+			    distance(&points[i], &c[a].center) ? b : a;
+			km->ndists += 2;
+			if (m == km->member[i])
 				continue;
+			c[km->member[i]].nelems--;
+			c[m].nelems++;
+			km->member[i] = m;
+			moved++;
+		}
+		adjmeans(km, !moved);
+	} while (moved);
+	return a;
+}
 
-			/* not done yet, move point to nearest cluster */
-			done = 0;
-			for (i = 0; i < nclusters; i++) {
-				if (ismember(&clusters[i], p)) {
-					delmember(&clusters[i], p);
-					break;
-				}
-			}
-			addmember(&clusters[mini], p);
+struct {
+	pthread_mutex_t lock;
+	uint64_t seed;
+	size_t next;
+	struct kmeans best;
+	long long bestsse;
+	size_t bestidx;
+} restarts = { PTHREAD_MUTEX_INITIALIZER };
+
+/* run restarts until there are none left, keep the lowest error one */
+void *
+restartworker(void *arg)
+{
+	struct kmeans km;
+	long long s;
+	size_t idx;
+
+	for (;;) {
+		pthread_mutex_lock(&restarts.lock);
+		idx = restarts.next++;
+		pthread_mutex_unlock(&restarts.lock);
+		if (idx >= nrestarts)
+			break;
+
+		rngseed(&km.rng, restarts.seed + idx);
+		initclusters(&km, nclusters);
+		process(&km);
+		s = sse(&km, -1);
+
+		pthread_mutex_lock(&restarts.lock);
+		if (!restarts.best.clusters || s < restarts.bestsse ||
+		    (s == restarts.bestsse && idx < restarts.bestidx)) {
+			if (restarts.best.clusters)
+				freeclusters(&restarts.best);
+			restarts.best = km;
+			restarts.bestsse = s;
+			restarts.bestidx = idx;
+		} else {
+			freeclusters(&km);
 		}
-		adjmeans(clusters, nclusters);
+		pthread_mutex_unlock(&restarts.lock);
 	}
+	return NULL;
+}
+
+int
+freqcmp(const void *a, const void *b)
+{
+	const struct point *p1 = a, *p2 = b;
+
+	if (p1->freq != p2->freq)
+		return p1->freq < p2->freq ? 1 : -1;
+	return pointcmp(a, b);
 }
 
+/*
+ * with no more colors than clusters every color is a cluster of its own,
+ * heaviest first
+ */
 void
-fillpoints(int r, int g, int b)
+exactclusters(struct kmeans *km, uint64_t seed)
 {
-	struct point n = { 0 };
-	struct point *p;
+	size_t i;
 
-	n.x = r, n.y = g, n.z = b;
-	p = RB_FIND(pointtree, &pointhead, &n);
-	if (p) {
-		p->freq++;
+	qsort(points, npoints, sizeof(*points), freqcmp);
+	rngseed(&km->rng, seed);
+	initclusters(km, npoints);
+	for (i = 0; i < npoints; i++) {
+		km->clusters[i].center = points[i];
+		km->clusters[i].nelems = 1;
+		km->member[i] = i;
+	}
+	adjmeans(km, 1);
+}
+
+/*
+ * cluster the points nrestarts times with seeds derived from seed on
+ * a pool of threads, the winner is the same for any number of threads
+ */
+void
+cluster(struct kmeans *km, uint64_t seed)
+{
+	pthread_t *thr;
+	long ncpu;
+	size_t i, nthr;
+
+	if (nrestarts == 1) {
+		rngseed(&km->rng, seed);
+		initclusters(km, nclusters);
+		process(km);
 		return;
 	}
 
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nthr = ncpu > 0 && ncpu < nrestarts ? ncpu : nrestarts;
+	if (!(thr = reallocarray(NULL, nthr, sizeof(*thr))))
+		err(1, "reallocarray");
+
+	restarts.seed = seed;
+	restarts.next = 0;
+	restarts.best.clusters = NULL;
+	for (i = 0; i < nthr; i++)
+		if ((errno = pthread_create(&thr[i], NULL, restartworker,
+		                            NULL)))
+			err(1, "pthread_create");
+	for (i = 0; i < nthr; i++)
+		pthread_join(thr[i], NULL);
+	free(thr);
+	*km = restarts.best;
+}
+
+/*
+ * the first colors are counted in a small array, flat images never
+ * outgrow it and don't touch the tree at all
+ */
+#define SMALLSET 32
+struct point smallset[SMALLSET];
+size_t nsmall;
+
+void
+insertpoint(struct point *pt)
+{
+	struct node *p;
+
 	p = malloc(sizeof(*p));
 	if (!p)
 		err(1, "malloc");
-	p->x = r;
-	p->y = g;
-	p->z = b;
-	p->freq = 1;
-	p->c = NULL;
-	npoints++;
+	p->p = *pt;
 	RB_INSERT(pointtree, &pointhead, p);
 }
 
+/* move the small set over to the tree once it is full */
 void
-printclusters(void)
+spillpoints(void)
 {
-	int i;
+	size_t i;
 
-	for (i = 0; i < nclusters; i++)
-		if (!isempty(&clusters[i]) || eflag)
-			printf("#%02x%02x%02x\n",
-			       clusters[i].center.x,
-			       clusters[i].center.y,
-			       clusters[i].center.z);
+	for (i = 0; i < nsmall; i++)
+		insertpoint(&smallset[i]);
+	nsmall = 0;
 }
 
+/* with several threads each adds to the shared histogram through its cache */
+struct hist hist;
+__thread struct histcache *cache;
+
 void
-printstatistics(void)
+fillpoints(int r, int g, int b, long long w)
 {
-	struct point *p;
-	size_t ntotalpoints = 0;
-	size_t navgcluster = 0;
+	struct node n = { 0 };
+	struct node *p;
+	size_t i;
 
-	RB_FOREACH(p, pointtree, &pointhead) {
-		ntotalpoints += p->freq;
-		navgcluster++;
+	if (cache) {
+		histcacheadd(&hist, cache, r << 16 | g << 8 | b, w);
+		return;
+	}
+	if (RB_EMPTY(&pointhead)) {
+		for (i = 0; i < nsmall; i++) {
+			if (smallset[i].x == r && smallset[i].y == g &&
+			    smallset[i].z == b) {
+				smallset[i].freq += w;
+				return;
+			}
+		}
+		if (nsmall < SMALLSET) {
+			smallset[nsmall].x = r;
+			smallset[nsmall].y = g;
+			smallset[nsmall].z = b;
+			smallset[nsmall++].freq = w;
+			npoints++;
+			return;
+		}
+		spillpoints();
 	}
-	navgcluster /= nclusters;
 
-	fprintf(stderr, "Total number of points: %zu\n", ntotalpoints);
-	fprintf(stderr, "Number of unique points: %zu\n", npoints);
-	fprintf(stderr, "Number of clusters: %zu\n", nclusters);
-	fprintf(stderr, "Average number of unique points per cluster: %zu\n",
-	        navgcluster);
-	fprintf(stderr, "Number of iterations to converge: %zu\n", niters);
+	n.p.x = r, n.p.y = g, n.p.z = b;
+	p = RB_FIND(pointtree, &pointhead, &n);
+	if (p) {
+		p->p.freq += w;
+		return;
+	}
+	n.p.freq = w;
+	npoints++;
+	insertpoint(&n.p);
 }
 
+/* the decoded image is only kept around to be remapped */
+uint8_t *img;
+uint32_t imgwidth, imgheight;
+
+/* only pixels inside the region and set in the mask count */
+struct region {
+	uint32_t x0, y0, x1, y1;
+} roi = { 0, 0, UINT32_MAX, UINT32_MAX };
+uint8_t *mask;
+uint32_t maskwidth, maskheight;
+double *wx; /* horizontal part of the center weights */
+
+/* pixels more transparent than the threshold don't count */
 void
-usage(void)
+countrow(uint32_t y, uint8_t *row)
 {
-	fprintf(stderr, "usage: %s [-erv] [-h | -p] [-n clusters]\n", argv0);
-	exit(1);
+	uint32_t x;
+
+	if (y < roi.y0 || y >= roi.y1)
+		return;
+	for (x = roi.x0, row += x * 4; x < roi.x1; x++, row += 4)
+		if (row[3] >= alphamin)
+			fillpoints(row[0], row[1], row[2], 1);
 }
 
-int
-main(int argc, char *argv[])
+/*
+ * with -a every pixel counts as much as it is opaque, and with -w the
+ * more the nearer it is to the center of the region, falling off like
+ * a gaussian to about 2% in the corners. The frequencies are in units
+ * of freqscale per pixel then.
+ */
+void
+countrow_weighted(uint32_t y, uint8_t *row)
 {
-	char *e;
-	int c;
+	uint8_t *m;
+	uint32_t x;
+	long long w;
+	double u, wy = 1;
 
-	ARGBEGIN {
-	case 'e':
-		eflag = 1;
-		break;
-	case 'r':
-		rflag = 1;
-		break;
-	case 'v':
-		vflag = 1;
-		break;
-	case 'h':
-		hflag = 1;
-		pflag = 0;
-		break;
-	case 'p':
-		pflag = 1;
-		hflag = 0;
-		break;
-	case 'n':
-		errno = 0;
-		nclusters = strtol(EARGF(usage()), &e, 10);
-		if (*e || errno || !nclusters)
-			errx(1, "invalid number");
-		break;
-	default:
-		usage();
-	} ARGEND;
+	if (y < roi.y0 || y >= roi.y1)
+		return;
+	if (wflag) {
+		u = (y + 0.5 - (roi.y0 + roi.y1) / 2.0) /
+		    ((roi.y1 - roi.y0) / 2.0);
+		wy = exp(-2 * u * u);
+	}
+	m = mask ? &mask[(size_t)y * imgwidth] : NULL;
+	for (x = roi.x0, row += x * 4; x < roi.x1; x++, row += 4) {
+		if (row[3] < alphamin || (m && !m[x]))
+			continue;
+		w = aflag ? row[3] : 1;
+		if (wflag)
+			w *= 1 + (int)(255 * wx[x] * wy);
+		fillpoints(row[0], row[1], row[2], w);
+	}
+}
 
-	if (argc != 0)
-		usage();
+void (*count)(uint32_t, uint8_t *) = countrow;
 
-	if ((c = getc(stdin)) == EOF || ungetc(c, stdin) == EOF)
-		return 1;
+/*
+ * with several threads the decoder hands the rows of the region over to
+ * the counting threads through a ring, which it waits on when it is full
+ */
+#define RINGROWS 64
 
-	RB_INIT(&pointhead);
+struct {
+	pthread_mutex_t lock;
+	pthread_cond_t filled, freed;
+	uint8_t *rows;
+	uint32_t y[RINGROWS];
+	int busy[RINGROWS]; /* until the row has been counted */
+	size_t head, tail;
+	int done;
+	pthread_t *thr;
+} ring = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER
+};
 
-	(c == 'f' ? parseimg_ff : parseimg_png)(stdin, fillpoints);
+void *
+countworker(void *arg)
+{
+	struct histcache c = { { 0 } };
+	size_t i;
 
-	initcluster = initcluster_greyscale;
-	initspace = 256;
+	cache = &c;
+	pthread_mutex_lock(&ring.lock);
+	for (;;) {
+		while (ring.tail == ring.head && !ring.done)
+			pthread_cond_wait(&ring.filled, &ring.lock);
+		if (ring.tail == ring.head)
+			break;
+		i = ring.tail++ % RINGROWS;
+		pthread_mutex_unlock(&ring.lock);
 
-	if (rflag)
-		srand(time(NULL));
-	if (pflag) {
-		initcluster = initcluster_pixel;
-		initspace = npoints;
+		count(ring.y[i], &ring.rows[i * imgwidth * 4]);
+
+		pthread_mutex_lock(&ring.lock);
+		ring.busy[i] = 0;
+		pthread_cond_signal(&ring.freed);
 	}
-	if (hflag) {
-		initcluster = initcluster_hue;
-		initspace = LEN(huetab) * 256;
+	pthread_mutex_unlock(&ring.lock);
+	histflush(&hist, &c);
+	cache = NULL;
+	return NULL;
+}
+
+void
+ringstart(void)
+{
+	size_t i;
+
+	if (!(ring.rows = reallocarray(ring.rows, RINGROWS, imgwidth * 4)) ||
+	    !(ring.thr = reallocarray(ring.thr, nthreads, sizeof(*ring.thr))))
+		err(1, "reallocarray");
+	ring.head = ring.tail = 0;
+	ring.done = 0;
+	for (i = 0; i < nthreads; i++)
+		if ((errno = pthread_create(&ring.thr[i], NULL, countworker,
+		                            NULL)))
+			err(1, "pthread_create");
+}
+
+void
+ringput(uint32_t y, uint8_t *row)
+{
+	size_t i;
+
+	pthread_mutex_lock(&ring.lock);
+	i = ring.head % RINGROWS;
+	while (ring.busy[i])
+		pthread_cond_wait(&ring.freed, &ring.lock);
+	pthread_mutex_unlock(&ring.lock);
+
+	/* the slot is the decoder's until head moves past it */
+	memcpy(&ring.rows[i * imgwidth * 4], row, imgwidth * 4);
+	ring.y[i] = y;
+
+	pthread_mutex_lock(&ring.lock);
+	ring.busy[i] = 1;
+	ring.head++;
+	pthread_cond_signal(&ring.filled);
+	pthread_mutex_unlock(&ring.lock);
+}
+
+/* wait for the rows still in the ring to be counted */
+void
+ringstop(void)
+{
+	size_t i;
+
+	pthread_mutex_lock(&ring.lock);
+	ring.done = 1;
+	pthread_cond_broadcast(&ring.filled);
+	pthread_mutex_unlock(&ring.lock);
+	for (i = 0; i < nthreads; i++)
+		pthread_join(ring.thr[i], NULL);
+}
+
+void
+imgsize(struct parser *pr, uint32_t width, uint32_t height)
+{
+	double u;
+	uint32_t x;
+
+	imgwidth = width;
+	imgheight = height;
+	if (mask && (maskwidth != width || maskheight != height))
+		errx(1, "mask is %ux%u but image is %ux%u", maskwidth,
+		     maskheight, width, height);
+	roi.x0 = MIN(roi.x0, width);
+	roi.x1 = MIN(roi.x1, width);
+	roi.y0 = MIN(roi.y0, height);
+	roi.y1 = MIN(roi.y1, height);
+
+	if (wflag) {
+		if (!(wx = reallocarray(wx, width, sizeof(*wx))))
+			err(1, "reallocarray");
+		for (x = roi.x0; x < roi.x1; x++) {
+			u = (x + 0.5 - (roi.x0 + roi.x1) / 2.0) /
+			    ((roi.x1 - roi.x0) / 2.0);
+			wx[x] = exp(-2 * u * u);
+		}
 	}
-	/* cap number of clusters */
-	if (nclusters > initspace)
-		nclusters = initspace;
 
-	initclusters(clusters, nclusters);
-	process();
-	printclusters();
-	if (vflag)
-		printstatistics();
+	/* the rows outside of the region need not be decoded at all */
+	if (!outfile) {
+		pr->y0 = roi.y0;
+		pr->y1 = roi.y1;
+	}
+	if (nthreads > 1) {
+		histinit(&hist, MIN((size_t)(roi.x1 - roi.x0) *
+		                    (roi.y1 - roi.y0), 1 << 24));
+		ringstart();
+	}
+	if (!outfile)
+		return;
+	if (!(img = reallocarray(img, (size_t)width * height, 4)))
+		err(1, "reallocarray");
+}
+
+void
+imgrow(struct parser *pr, uint32_t y, uint8_t *row)
+{
+	if (img)
+		memcpy(&img[(size_t)y * imgwidth * 4], row, imgwidth * 4);
+	if (nthreads == 1)
+		count(y, row);
+	else if (y >= roi.y0 && y < roi.y1)
+		ringput(y, row);
+}
+
+/* rows without alpha, every pixel counts */
+void
+imgrow_rgb(struct parser *pr, uint32_t y, uint8_t *row)
+{
+	uint32_t x;
+
+	if (y < roi.y0 || y >= roi.y1)
+		return;
+	for (x = roi.x0, row += x * 3; x < roi.x1; x++, row += 3)
+		fillpoints(row[0], row[1], row[2], 1);
+}
+
+/*
+ * palette images only count how often each index shows up, the colors
+ * go into the histogram once the image is done
+ */
+long long palcount[256];
+
+void
+imgrow_idx(struct parser *pr, uint32_t y, uint8_t *row)
+{
+	uint32_t x;
+
+	if (y < roi.y0 || y >= roi.y1)
+		return;
+	for (x = roi.x0; x < roi.x1; x++)
+		palcount[row[x]]++;
+}
+
+void
+flushpalette(struct parser *pr)
+{
+	uint8_t *c;
+	long long w;
+	int i;
+
+	for (i = 0; i < 256; i++) {
+		c = pr->pal[i];
+		if (!palcount[i] || c[3] < alphamin) {
+			palcount[i] = 0;
+			continue;
+		}
+		w = palcount[i] * (aflag ? c[3] : 1);
+		if (nthreads > 1)
+			histadd(&hist, c[0] << 16 | c[1] << 8 | c[2], w);
+		else
+			fillpoints(c[0], c[1], c[2], w);
+		palcount[i] = 0;
+	}
+}
+
+struct parser parser = { imgsize, imgrow };
+
+/* the same as flattenpoints() for the shared histogram, in tree order */
+void
+flattenhist(void)
+{
+	size_t i;
+
+	npoints = 0;
+	for (i = 0; i < hist.cap; i++)
+		npoints += hist.keys[i] != 0;
+	/* an empty histogram still gets an array */
+	if (!(points = reallocarray(points, MAX(npoints, 1), sizeof(*points))))
+		err(1, "reallocarray");
+	ntotal = 0;
+	for (i = 0, npoints = 0; i < hist.cap; i++) {
+		if (!hist.keys[i])
+			continue;
+		points[npoints].x = (hist.keys[i] - 1) >> 16;
+		points[npoints].y = (hist.keys[i] - 1) >> 8 & 0xff;
+		points[npoints].z = (hist.keys[i] - 1) & 0xff;
+		points[npoints++].freq = hist.freqs[i];
+		ntotal += hist.freqs[i];
+	}
+	qsort(points, npoints, sizeof(*points), pointcmp);
+}
+
+/* lay the histogram out as an array for clustering */
+void
+flattenpoints(int keep)
+{
+	struct node *n, *tmp;
+	size_t i = 0;
+
+	/* an empty histogram still gets an array */
+	if (!(points = reallocarray(points, MAX(npoints, 1), sizeof(*points))))
+		err(1, "reallocarray");
+	ntotal = 0;
+	/* a histogram that is kept for later has to live in the tree */
+	if (keep)
+		spillpoints();
+	for (; i < nsmall; i++) {
+		ntotal += smallset[i].freq;
+		points[i] = smallset[i];
+	}
+	qsort(points, nsmall, sizeof(*points), pointcmp);
+	nsmall = 0;
+	RB_FOREACH_SAFE(n, pointtree, &pointhead, tmp) {
+		ntotal += n->p.freq;
+		points[i++] = n->p;
+		if (keep)
+			continue;
+		RB_REMOVE(pointtree, &pointhead, n);
+		free(n);
+	}
+}
+
+/* interleave the bits of the channels, so cells of any size are contiguous */
+uint32_t
+morton(struct point *p)
+{
+	uint32_t k = 0;
+	int i;
+
+	for (i = 7; i >= 0; i--)
+		k = k << 3 | (p->x >> i & 1) << 2 | (p->y >> i & 1) << 1 |
+		    (p->z >> i & 1);
+	return k;
+}
+
+int
+keycmp(const void *a, const void *b)
+{
+	uint64_t k1 = *(const uint64_t *)a, k2 = *(const uint64_t *)b;
+
+	return k1 < k2 ? -1 : k1 > k2;
+}
+
+/*
+ * merge the points within the cells of the finest grid that leaves at most
+ * coresize of them, every cell becomes one point at the weighted mean of
+ * its colors, which moves no color further than the diagonal of a cell
+ */
+void
+reducepoints(void)
+{
+	struct point *merged, *p;
+	uint64_t *keys, cell;
+	long long x, y, z, w;
+	size_t i, j, n;
+	int shift;
+	double t;
+
+	nfullpoints = npoints;
+	coreshift = 0;
+	if (!coresize || npoints <= coresize)
+		return;
+
+	t = now();
+	/* the index of the point is kept in the low half of the key */
+	if (!(keys = reallocarray(NULL, npoints, sizeof(*keys))))
+		err(1, "reallocarray");
+	for (i = 0; i < npoints; i++)
+		keys[i] = (uint64_t)morton(&points[i]) << 32 | i;
+	qsort(keys, npoints, sizeof(*keys), keycmp);
+
+	/* a single cell holds everything, so this always ends */
+	for (coreshift = 1;; coreshift++) {
+		shift = 32 + 3 * coreshift;
+		for (n = 1, i = 1; i < npoints; i++)
+			n += keys[i] >> shift != keys[i - 1] >> shift;
+		if (n <= coresize)
+			break;
+	}
+
+	if (!(merged = reallocarray(NULL, n, sizeof(*merged))))
+		err(1, "reallocarray");
+	for (i = 0, j = 0; i < npoints; j++) {
+		x = y = z = w = 0;
+		cell = keys[i] >> shift;
+		merged[j].ncolors = 0;
+		do {
+			p = &points[keys[i] & UINT32_MAX];
+			x += p->x * p->freq;
+			y += p->y * p->freq;
+			z += p->z * p->freq;
+			w += p->freq;
+			merged[j].ncolors++;
+		} while (++i < npoints && keys[i] >> shift == cell);
+		merged[j].x = (x + w / 2) / w;
+		merged[j].y = (y + w / 2) / w;
+		merged[j].z = (z + w / 2) / w;
+		merged[j].freq = w;
+	}
+	free(keys);
+	free(points);
+	points = merged;
+	npoints = n;
+	coretime = now() - t;
+}
+
+/* age the histogram, colors that fade out completely are dropped */
+void
+decaypoints(void)
+{
+	struct node *n, *tmp;
+
+	RB_FOREACH_SAFE(n, pointtree, &pointhead, tmp) {
+		n->p.freq = n->p.freq * decay / 100;
+		if (n->p.freq)
+			continue;
+		RB_REMOVE(pointtree, &pointhead, n);
+		free(n);
+		npoints--;
+	}
+}
+
+/*
+ * replace every pixel of the image by its nearest cluster center, with
+ * Floyd-Steinberg dithering the error is spread over the neighbours
+ */
+void
+remap(struct kmeans *km)
+{
+	struct lut lut;
+	int (*pal)[3], *errs, *cur, *next, *tmp, *q;
+	int rgb[3], npal = 0, v, e, i;
+	uint32_t x, y;
+	uint8_t *px;
+
+	if (!(pal = reallocarray(NULL, km->nclusters, sizeof(*pal))) &&
+	    km->nclusters)
+		err(1, "reallocarray");
+	for (i = 0; i < km->nclusters; i++) {
+		if (isempty(&km->clusters[i]))
+			continue;
+		pal[npal][0] = km->clusters[i].center.x;
+		pal[npal][1] = km->clusters[i].center.y;
+		pal[npal][2] = km->clusters[i].center.z;
+		npal++;
+	}
+	if (!npal) {
+		free(pal);
+		return;
+	}
+	lutinit(&lut, pal, npal);
+
+	/* errors times 16 of this row and the next, with a pixel of margin */
+	if (!(errs = calloc(2 * ((size_t)imgwidth + 2) * 3, sizeof(*errs))))
+		err(1, "calloc");
+	cur = errs;
+	next = errs + (imgwidth + 2) * 3;
+
+	for (y = 0, px = img; y < imgheight; y++) {
+		memset(next, 0, (imgwidth + 2) * 3 * sizeof(*next));
+		for (x = 0; x < imgwidth; x++, px += 4) {
+			if (!px[3])
+				continue;
+			for (i = 0; i < 3; i++) {
+				v = px[i] + cur[(x + 1) * 3 + i] / 16;
+				rgb[i] = v < 0 ? 0 : v > 255 ? 255 : v;
+			}
+			q = pal[lutnearest(&lut, rgb)];
+			for (i = 0; i < 3; i++) {
+				px[i] = q[i];
+				if (!dflag)
+					continue;
+				e = rgb[i] - q[i];
+				cur[(x + 2) * 3 + i] += e * 7;
+				next[x * 3 + i] += e * 3;
+				next[(x + 1) * 3 + i] += e * 5;
+				next[(x + 2) * 3 + i] += e;
+			}
+		}
+		tmp = cur, cur = next, next = tmp;
+	}
+	free(errs);
+	lutfree(&lut);
+	free(pal);
+}
+
+/* the format is chosen by the extension, farbfeld unless .png */
+void
+writeimg(const char *path)
+{
+	const char *ext = strrchr(path, '.');
+	FILE *fp;
+
+	if (!(fp = fopen(path, "w")))
+		err(1, "fopen %s", path);
+	if (ext && !strcmp(ext, ".png"))
+		writeimg_png(fp, imgwidth, imgheight, img);
+	else
+		writeimg_ff(fp, imgwidth, imgheight, img);
+	if (fclose(fp) == EOF)
+		err(1, "fclose %s", path);
+}
+
+struct buf out;
+
+void
+palette_hex(struct kmeans *km, struct cluster **c, size_t n, int sweep)
+{
+	size_t i;
+
+	if (sweep)
+		bufprintf(&out, "k=%zu sse=%lld\n", km->nclusters, pixels(sse(km, -1)));
+	/* one line per frame or image when there are several */
+	if (label)
+		bufprintf(&out, "%s: ", label);
+	for (i = 0; i < n; i++)
+		bufprintf(&out, "#%02x%02x%02x%c",
+		          c[i]->center.x,
+		          c[i]->center.y,
+		          c[i]->center.z,
+		          (Fflag || label) && i + 1 < n ? ' ' : '\n');
+	/* an empty palette still ends its line */
+	if (!n && (Fflag || label))
+		bufprintf(&out, "\n");
+}
+
+double
+percent(struct cluster *c)
+{
+	return ntotal ? 100.0 * c->tmp.nmembers / ntotal : 0;
+}
+
+/* unique colors of a cluster, a point of the coreset stands for several */
+size_t
+unique(struct kmeans *km, struct cluster *c)
+{
+	size_t i, n = 0;
+	int m = c - km->clusters;
+
+	if (!coreshift)
+		return c->nelems;
+	for (i = 0; i < npoints; i++)
+		if (km->member[i] == m)
+			n += points[i].ncolors;
+	return n;
+}
+
+/*
+ * one line per color with its weight in pixels, percentage of the image,
+ * number of unique colors and variance
+ */
+void
+palette_tab(struct kmeans *km, struct cluster **c, size_t n, int sweep)
+{
+	size_t i;
+
+	if (label)
+		bufprintf(&out, "%s:\n", label);
+	if (sweep)
+		bufprintf(&out, "k=%zu sse=%lld\n", km->nclusters, pixels(sse(km, -1)));
+	for (i = 0; i < n; i++)
+		bufprintf(&out, "#%02x%02x%02x\t%lld\t%.4f\t%zu\t%.4f\n",
+		          c[i]->center.x, c[i]->center.y, c[i]->center.z,
+		          pixels(c[i]->tmp.nmembers), percent(c[i]), unique(km, c[i]),
+		          c[i]->variance);
+}
+
+/* the name of the image as the first member of an object */
+void
+json_label(void)
+{
+	char *s;
+
+	bufprintf(&out, "\"image\":\"");
+	for (s = label; *s; s++) {
+		if (*s == '"' || *s == '\\')
+			bufprintf(&out, "\\%c", *s);
+		else if ((unsigned char)*s < 0x20)
+			bufprintf(&out, "\\u%04x", *s);
+		else
+			bufprintf(&out, "%c", *s);
+	}
+	bufprintf(&out, "\",");
+}
+
+void
+tree_json(struct split *t, int n)
+{
+	bufprintf(&out, "{");
+	if (label && !n)
+		json_label();
+	bufprintf(&out, "\"color\":\"#%02x%02x%02x\",\"weight\":%lld,"
+	          "\"percent\":%.4f", t[n].center.x, t[n].center.y,
+	          t[n].center.z, pixels(t[n].weight),
+	          ntotal ? 100.0 * t[n].weight / ntotal : 0);
+	if (t[n].child >= 0) {
+		bufprintf(&out, ",\"children\":[");
+		tree_json(t, t[n].child);
+		bufprintf(&out, ",");
+		tree_json(t, t[n].child + 1);
+		bufprintf(&out, "]");
+	}
+	bufprintf(&out, "}");
+}
+
+/* one object per palette and line */
+void
+palette_json(struct kmeans *km, struct cluster **c, size_t n, int sweep)
+{
+	size_t i;
+
+	bufprintf(&out, "{");
+	if (label)
+		json_label();
+	bufprintf(&out, "\"k\":%zu,\"sse\":%lld,\"colors\":[",
+	          km->nclusters, pixels(sse(km, -1)));
+	for (i = 0; i < n; i++)
+		bufprintf(&out, "%s{\"color\":\"#%02x%02x%02x\","
+		          "\"weight\":%lld,\"percent\":%.4f,\"unique\":%zu,"
+		          "\"variance\":%.4f}", i ? "," : "",
+		          c[i]->center.x, c[i]->center.y, c[i]->center.z,
+		          pixels(c[i]->tmp.nmembers), percent(c[i]), unique(km, c[i]),
+		          c[i]->variance);
+	bufprintf(&out, "]}\n");
+}
+
+/* X resources, aligned like column -t */
+void
+palette_xrdb(struct kmeans *km, struct cluster **c, size_t n, int sweep)
+{
+	char name[32];
+	int width;
+	size_t i;
+
+	if (label)
+		bufprintf(&out, "! %s\n", label);
+	if (sweep)
+		bufprintf(&out, "! k=%zu sse=%lld\n", km->nclusters, pixels(sse(km, -1)));
+	width = snprintf(name, sizeof(name), "*color%zu:", n ? n - 1 : 0);
+	for (i = 0; i < n; i++) {
+		snprintf(name, sizeof(name), "*color%zu:", i);
+		bufprintf(&out, "%-*s  #%02x%02x%02x\n", width, name,
+		          c[i]->center.x, c[i]->center.y, c[i]->center.z);
+	}
+}
+
+void
+html_begin(void)
+{
+	bufprintf(&out,
+	          "<!DOCTYPE html>\n"
+	          "<html>\n"
+	          "<head>\n"
+	          "<style>\n"
+	          ".color-sample {\n"
+	          "   float: left;\n"
+	          "   margin: 2px;\n"
+	          "   width: 64px;\n"
+	          "   height: 64px;\n"
+	          "   border-radius: 3px;\n"
+	          "}\n"
+	          "</style>\n"
+	          "</head>\n"
+	          "<body>\n");
+}
+
+void
+palette_html(struct kmeans *km, struct cluster **c, size_t n, int sweep)
+{
+	char *s;
+	size_t i;
+
+	if (label) {
+		bufprintf(&out, "<h2 style=\"clear: both\">");
+		for (s = label; *s; s++) {
+			if (*s == '&')
+				bufprintf(&out, "&amp;");
+			else if (*s == '<')
+				bufprintf(&out, "&lt;");
+			else if (*s == '>')
+				bufprintf(&out, "&gt;");
+			else
+				bufprintf(&out, "%c", *s);
+		}
+		bufprintf(&out, "</h2>\n");
+	}
+	if (sweep)
+		bufprintf(&out, "<h3 style=\"clear: both\">k=%zu sse=%lld</h3>\n",
+		          km->nclusters, pixels(sse(km, -1)));
+	for (i = 0; i < n; i++)
+		bufprintf(&out, "<div class=\"color-sample\" "
+		          "style=\"background: #%02x%02x%02x\"></div>\n",
+		          c[i]->center.x, c[i]->center.y, c[i]->center.z);
+}
+
+void
+html_end(void)
+{
+	bufprintf(&out, "</body>\n</html>\n");
+}
+
+/*
+ * per palette a 32-bit count of colors, then for each color its red,
+ * green and blue byte and a 64-bit weight, all big endian. With several
+ * images the palette follows the 32-bit length and bytes of the name
+ */
+void
+palette_bin(struct kmeans *km, struct cluster **c, size_t n, int sweep)
+{
+	unsigned char rec[11];
+	uint64_t w;
+	size_t i, len;
+	int j;
+
+	if (label) {
+		len = strlen(label);
+		for (j = 0; j < 4; j++)
+			rec[j] = (uint32_t)len >> (24 - j * 8);
+		bufwrite(&out, rec, 4);
+		bufwrite(&out, label, len);
+	}
+	for (j = 0; j < 4; j++)
+		rec[j] = (uint32_t)n >> (24 - j * 8);
+	bufwrite(&out, rec, 4);
+	for (i = 0; i < n; i++) {
+		rec[0] = c[i]->center.x;
+		rec[1] = c[i]->center.y;
+		rec[2] = c[i]->center.z;
+		w = pixels(c[i]->tmp.nmembers);
+		for (j = 0; j < 8; j++)
+			rec[3 + j] = w >> (56 - j * 8);
+		bufwrite(&out, rec, sizeof(rec));
+	}
+}
+
+/* heaviest first, clusters of equal weight stay in order */
+int
+weightcmp(const void *a, const void *b)
+{
+	struct cluster *ca = *(struct cluster **)a, *cb = *(struct cluster **)b;
+
+	if (ca->tmp.nmembers != cb->tmp.nmembers)
+		return ca->tmp.nmembers < cb->tmp.nmembers ? 1 : -1;
+	return ca < cb ? -1 : ca > cb;
+}
+
+struct format {
+	char *name;
+	void (*begin)(void);
+	void (*palette)(struct kmeans *, struct cluster **, size_t, int);
+	void (*end)(void);
+	void (*tree)(struct split *, int); /* the whole bisection at once */
+} formats[] = {
+	{ "hex",  NULL,       palette_hex,  NULL,     NULL      },
+	{ "tab",  NULL,       palette_tab,  NULL,     NULL      },
+	{ "json", NULL,       palette_json, NULL,     tree_json },
+	{ "xrdb", NULL,       palette_xrdb, NULL,     NULL      },
+	{ "html", html_begin, palette_html, html_end, NULL      },
+	{ "bin",  NULL,       palette_bin,  NULL,     NULL      },
+}, *format = &formats[0];
+
+void
+printclusters(struct kmeans *km)
+{
+	struct cluster **sel;
+	size_t i, n = 0;
+
+	if (!(sel = reallocarray(NULL, km->nclusters, sizeof(*sel))) &&
+	    km->nclusters)
+		err(1, "reallocarray");
+	for (i = 0; i < km->nclusters; i++)
+		if (!isempty(&km->clusters[i]) || eflag)
+			sel[n++] = &km->clusters[i];
+	if (sflag)
+		qsort(sel, n, sizeof(*sel), weightcmp);
+	format->palette(km, sel, n, maxclusters != 0);
+	free(sel);
+}
+
+void
+printstatistics(struct kmeans *km)
+{
+	struct rusage ru;
+	struct iter *it;
+	size_t ntotalpoints = 0;
+	size_t navgcluster = 0;
+	size_t i;
+
+	for (i = 0; i < npoints; i++) {
+		ntotalpoints += points[i].freq;
+		navgcluster++;
+	}
+	ntotalpoints = pixels(ntotalpoints);
+	if (km->nclusters)
+		navgcluster /= km->nclusters;
+	getrusage(RUSAGE_SELF, &ru);
+
+	fprintf(stderr, "Total number of points: %zu\n", ntotalpoints);
+	fprintf(stderr, "Number of unique points: %zu\n", nfullpoints);
+	if (coreshift)
+		fprintf(stderr, "Reduced to %zu points (%.2f%%) in cells of %d "
+		        "in %.6fs\n", npoints, 100.0 * npoints / nfullpoints,
+		        1 << coreshift, coretime);
+	fprintf(stderr, "Number of clusters: %zu\n", km->nclusters);
+	fprintf(stderr, "Average number of unique points per cluster: %zu\n",
+	        navgcluster);
+	fprintf(stderr, "Number of iterations to converge: %zu\n", km->niters);
+	if (nrestarts > 1)
+		fprintf(stderr, "Best of %zu restarts: %zu\n", nrestarts,
+		        restarts.bestidx);
+	fprintf(stderr, "Decoding time: %.6fs\n", parser.decodetime);
+	fprintf(stderr, "Histogram time: %.6fs\n",
+	        ingesttime - parser.decodetime);
+	fprintf(stderr, "Seeding time: %.6fs\n", km->seeding);
+	for (i = 0; i < km->niters; i++) {
+		it = &km->iters[i];
+		fprintf(stderr, "Iteration %zu: %.6fs assignment, %.6fs means, "
+		        "%zu points moved\n", i + 1, it->assign, it->means,
+		        it->moved);
+	}
+	fprintf(stderr, "Number of distance evaluations: %llu\n", km->ndists);
+	fprintf(stderr, "Peak resident set size: %ldkB\n", ru.ru_maxrss);
+
+	/* the same as a single line for scripts */
+	fprintf(stderr, "{\"points\":%zu,\"unique\":%zu,\"reduced\":%zu,"
+	        "\"clusters\":%zu,\"iterations\":%zu,\"restarts\":%zu,"
+	        "\"decode\":%.6f,\"histogram\":%.6f,\"seeding\":%.6f,"
+	        "\"assign\":[", ntotalpoints, nfullpoints, npoints,
+	        km->nclusters, km->niters, nrestarts, parser.decodetime,
+	        ingesttime - parser.decodetime, km->seeding);
+	for (i = 0; i < km->niters; i++)
+		fprintf(stderr, "%s%.6f", i ? "," : "", km->iters[i].assign);
+	fprintf(stderr, "],\"means\":[");
+	for (i = 0; i < km->niters; i++)
+		fprintf(stderr, "%s%.6f", i ? "," : "", km->iters[i].means);
+	fprintf(stderr, "],\"moved\":[");
+	for (i = 0; i < km->niters; i++)
+		fprintf(stderr, "%s%zu", i ? "," : "", km->iters[i].moved);
+	fprintf(stderr, "],\"distances\":%llu,\"maxrss\":%ld}\n",
+	        km->ndists, ru.ru_maxrss);
+}
+
+void
+masksize(struct parser *pr, uint32_t width, uint32_t height)
+{
+	maskwidth = width;
+	maskheight = height;
+	if (!(mask = calloc((size_t)width * height, 1)))
+		err(1, "calloc");
+}
+
+/* opaque pixels that aren't black are in the mask */
+void
+maskrow(struct parser *pr, uint32_t y, uint8_t *row)
+{
+	uint8_t *m = &mask[(size_t)y * maskwidth];
+	uint32_t x;
+
+	for (x = 0; x < maskwidth; x++, row += 4)
+		m[x] = row[3] && (row[0] || row[1] || row[2]);
+}
+
+/* read the mask and shrink the region to the part of it that is set */
+void
+loadmask(const char *path)
+{
+	struct parser pr = { masksize, maskrow };
+	uint32_t x, y, x0 = UINT32_MAX, y0 = UINT32_MAX, x1 = 0, y1 = 0;
+	FILE *fp;
+	int c;
+
+	if (!(fp = fopen(path, "r")))
+		err(1, "fopen %s", path);
+	if ((c = getc(fp)) == EOF || ungetc(c, fp) == EOF)
+		errx(1, "%s: empty mask", path);
+	(c == 'f' ? parseimg_ff : parseimg_png)(fp, &pr);
+	fclose(fp);
+
+	for (y = 0; y < maskheight; y++) {
+		for (x = 0; x < maskwidth; x++) {
+			if (!mask[(size_t)y * maskwidth + x])
+				continue;
+			x0 = MIN(x0, x), x1 = MAX(x1, x + 1);
+			y0 = MIN(y0, y), y1 = MAX(y1, y + 1);
+		}
+	}
+	roi.x0 = MAX(roi.x0, x0);
+	roi.y0 = MAX(roi.y0, y0);
+	roi.x1 = MIN(roi.x1, x1);
+	roi.y1 = MIN(roi.y1, y1);
+}
+
+/* widthxheight[+x+y], as in X11 geometries */
+void
+parsegeometry(const char *s)
+{
+	unsigned long w, h, x = 0, y = 0;
+	char *e;
+
+	errno = 0;
+	w = strtoul(s, &e, 10);
+	if (*e++ != 'x')
+		errx(1, "invalid geometry");
+	h = strtoul(e, &e, 10);
+	if (*e == '+') {
+		x = strtoul(e + 1, &e, 10);
+		if (*e++ != '+')
+			errx(1, "invalid geometry");
+		y = strtoul(e, &e, 10);
+	}
+	if (*e || errno || !w || !h || x > UINT32_MAX - w || y > UINT32_MAX - h)
+		errx(1, "invalid geometry");
+	roi.x0 = x;
+	roi.y0 = y;
+	roi.x1 = x + w;
+	roi.y1 = y + h;
+}
+
+void
+initsetup(void)
+{
+	initcluster = initcluster_greyscale;
+	initspace = 256;
+
+	if (pflag) {
+		initcluster = initcluster_pixel;
+		initspace = npoints;
+	}
+	if (hflag) {
+		initcluster = initcluster_hue;
+		initspace = LEN(huetab) * 256;
+	}
+	/* cap number of clusters */
+	if (nclusters > initspace)
+		nclusters = initspace;
+	/* a sweep can't have more centers than unique points */
+	if (maxclusters > npoints)
+		maxclusters = npoints;
+}
+
+int
+setclusters(char *s)
+{
+	char *e;
+
+	errno = 0;
+	maxclusters = 0;
+	nclusters = strtol(s, &e, 10);
+	if (*e == '-')
+		maxclusters = strtol(e + 1, &e, 10);
+	if (*e || errno || !nclusters ||
+	    (maxclusters && maxclusters < nclusters))
+		return -1;
+	return 0;
+}
+
+int
+setformat(char *s)
+{
+	size_t i;
+
+	for (i = 0; i < LEN(formats); i++)
+		if (!strcmp(s, formats[i].name))
+			break;
+	if (i == LEN(formats))
+		return -1;
+	format = &formats[i];
+	return 0;
+}
+
+void
+setsplit(struct split *t, struct cluster *c)
+{
+	t->center = c->center;
+	t->weight = c->tmp.nmembers;
+	t->child = -1;
+}
+
+/*
+ * bisecting k-means, from one cluster up to the number asked for: every
+ * palette is the one before with a color split in two, all of them are
+ * printed, or the tree of splits if the format has one
+ */
+void
+bisect(struct kmeans *km, uint64_t seed)
+{
+	struct split *t;
+	size_t lo, hi, max = maxclusters;
+	int *leaf, n = 1, a, b;
+
+	lo = maxclusters ? nclusters : 1;
+	hi = maxclusters ? maxclusters : nclusters;
+	hi = MAX(MIN(hi, npoints), 1);
+	/* room for every split, and sweep headers, for this image only */
+	maxclusters = hi;
+	rngseed(&km->rng, seed);
+	initclusters(km, 1);
+	process(km);
+
+	if (!(t = reallocarray(NULL, 2 * hi - 1, sizeof(*t))) ||
+	    !(leaf = reallocarray(NULL, hi, sizeof(*leaf))))
+		err(1, "reallocarray");
+	setsplit(&t[0], &km->clusters[0]);
+	leaf[0] = 0;
+	for (;;) {
+		if (km->nclusters >= lo && !format->tree)
+			printclusters(km);
+		/* nothing left to split once every color is on its own */
+		if (km->nclusters >= hi || !sse(km, -1))
+			break;
+		a = bisectcluster(km);
+		b = km->nclusters - 1;
+		t[leaf[a]].child = n;
+		leaf[a] = n++;
+		leaf[b] = n++;
+		setsplit(&t[leaf[a]], &km->clusters[a]);
+		setsplit(&t[leaf[b]], &km->clusters[b]);
+	}
+	if (format->tree) {
+		format->tree(t, 0);
+		bufprintf(&out, "\n");
+	}
+	free(leaf);
+	free(t);
+	maxclusters = max;
+}
+
+/* cluster the image in fp and print its palette into out */
+void
+ingested(double t)
+{
+	if (nthreads > 1) {
+		ringstop();
+		flattenhist();
+	} else {
+		flattenpoints(0);
+	}
+	ingesttime = now() - t;
+	reducepoints();
+}
+
+/* decode the image in fp into the histogram */
+int
+ingest(FILE *fp)
+{
+	double t;
+	int c;
+
+	if ((c = getc(fp)) == EOF || ungetc(c, fp) == EOF)
+		return -1;
+
+	npoints = 0;
+	parser.decodetime = 0;
+	t = now();
+	(c == 'f' ? parseimg_ff : parseimg_png)(fp, &parser);
+	flushpalette(&parser);
+	ingested(t);
+	return 0;
+}
+
+/* images are read front to back in large chunks */
+FILE *
+openimg(const char *path)
+{
+	FILE *fp;
+
+	if (!(fp = fopen(path, "r")))
+		err(1, "fopen %s", path);
+	/* start reading ahead before the previous image is done with */
+	posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_SEQUENTIAL);
+	posix_fadvise(fileno(fp), 0, 0, POSIX_FADV_WILLNEED);
+	if (setvbuf(fp, NULL, _IOFBF, 1 << 20))
+		errx(1, "setvbuf %s", path);
+	return fp;
+}
+
+/*
+ * with several images the next ones are decoded on a thread of their own,
+ * at most AHEAD of them waiting, while the current one is clustered
+ */
+#define AHEAD 2
+
+struct decoded {
+	struct parser pr; /* first, the callbacks get the image from it */
+	uint8_t *pix;
+	uint32_t width, height;
+	int bpp; /* 4 or 3 for rows in pix, 1 for palette counts */
+	long long palcount[256];
+	int ready;
+};
+
+struct {
+	pthread_mutex_t lock;
+	pthread_cond_t ready, taken;
+	struct decoded *imgs;
+	char **paths;
+	size_t n, ntaken;
+	struct region req;
+	pthread_t thr;
+} ahead = {
+	PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+	PTHREAD_COND_INITIALIZER
+};
+
+void
+aheadsize(struct parser *pr, uint32_t width, uint32_t height)
+{
+	struct decoded *d = (struct decoded *)pr;
+
+	d->width = width;
+	d->height = height;
+	pr->y0 = MIN(ahead.req.y0, height);
+	pr->y1 = MIN(ahead.req.y1, height);
+}
+
+/* the rows are kept in the form the decoder hands them over */
+void
+aheadkeep(struct decoded *d, uint32_t y, uint8_t *row, int bpp)
+{
+	if (!d->pix) {
+		d->bpp = bpp;
+		if (!(d->pix = reallocarray(NULL, (size_t)d->width * d->height,
+		                            bpp)))
+			err(1, "reallocarray");
+	}
+	memcpy(&d->pix[(size_t)y * d->width * bpp], row, d->width * bpp);
+}
+
+void
+aheadrow(struct parser *pr, uint32_t y, uint8_t *row)
+{
+	aheadkeep((struct decoded *)pr, y, row, 4);
+}
+
+void
+aheadrgb(struct parser *pr, uint32_t y, uint8_t *row)
+{
+	aheadkeep((struct decoded *)pr, y, row, 3);
+}
+
+/* palette images are counted right away, as ingest() does */
+void
+aheadidx(struct parser *pr, uint32_t y, uint8_t *row)
+{
+	struct decoded *d = (struct decoded *)pr;
+	uint32_t x, x1 = MIN(ahead.req.x1, d->width);
+
+	d->bpp = 1;
+	for (x = MIN(ahead.req.x0, d->width); x < x1; x++)
+		d->palcount[row[x]]++;
+}
+
+void *
+aheadworker(void *arg)
+{
+	struct decoded *d;
+	FILE *fp;
+	size_t i;
+	int c;
+
+	for (i = 0; i < ahead.n; i++) {
+		pthread_mutex_lock(&ahead.lock);
+		while (i >= ahead.ntaken + AHEAD)
+			pthread_cond_wait(&ahead.taken, &ahead.lock);
+		pthread_mutex_unlock(&ahead.lock);
+
+		d = &ahead.imgs[i];
+		d->pr.size = aheadsize;
+		d->pr.row = aheadrow;
+		d->pr.rgbrow = parser.rgbrow ? aheadrgb : NULL;
+		d->pr.idxrow = parser.idxrow ? aheadidx : NULL;
+		d->pr.trusted = parser.trusted;
+		fp = openimg(ahead.paths[i]);
+		if ((c = getc(fp)) == EOF || ungetc(c, fp) == EOF)
+			errx(1, "%s: empty image", ahead.paths[i]);
+		(c == 'f' ? parseimg_ff : parseimg_png)(fp, &d->pr);
+		fclose(fp);
+
+		pthread_mutex_lock(&ahead.lock);
+		d->ready = 1;
+		pthread_cond_signal(&ahead.ready);
+		pthread_mutex_unlock(&ahead.lock);
+	}
+	return NULL;
+}
+
+void
+aheadstart(char **paths, size_t n)
+{
+	if (!(ahead.imgs = calloc(n, sizeof(*ahead.imgs))))
+		err(1, "calloc");
+	ahead.paths = paths;
+	ahead.n = n;
+	ahead.req = roi;
+	if ((errno = pthread_create(&ahead.thr, NULL, aheadworker, NULL)))
+		err(1, "pthread_create");
+}
+
+/* feed image i to the histogram as if it was being decoded right now */
+void
+replay(size_t i)
+{
+	struct decoded *d = &ahead.imgs[i];
+	uint32_t y;
+	double t;
+
+	pthread_mutex_lock(&ahead.lock);
+	while (!d->ready)
+		pthread_cond_wait(&ahead.ready, &ahead.lock);
+	pthread_mutex_unlock(&ahead.lock);
+
+	npoints = 0;
+	t = now();
+	parser.y0 = 0;
+	parser.y1 = d->height;
+	parser.size(&parser, d->width, d->height);
+	if (d->bpp == 1) {
+		memcpy(palcount, d->palcount, sizeof(palcount));
+		memcpy(parser.pal, d->pr.pal, sizeof(parser.pal));
+		flushpalette(&parser);
+	} else if (d->pix) {
+		for (y = parser.y0; y < parser.y1; y++)
+			(d->bpp == 3 ? parser.rgbrow : parser.row)(&parser, y,
+			    &d->pix[(size_t)y * d->width * d->bpp]);
+	}
+	ingested(t);
+	parser.decodetime = d->pr.decodetime;
+	ingesttime += d->pr.decodetime;
+
+	free(d->pix);
+	pthread_mutex_lock(&ahead.lock);
+	ahead.ntaken = i + 1;
+	pthread_cond_signal(&ahead.taken);
+	pthread_mutex_unlock(&ahead.lock);
+}
+
+/* cluster the histogram and print the palette into out */
+void
+quantize(struct kmeans *km, uint64_t seed)
+{
+	initsetup();
+	/* there is nothing to seed from in an empty image or region */
+	if (!npoints) {
+		memset(km, 0, sizeof(*km));
+		printclusters(km);
+		return;
+	}
+	if (bflag) {
+		bisect(km, seed);
+		return;
+	}
+	if (npoints <= nclusters)
+		exactclusters(km, seed);
+	else
+		cluster(km, seed);
+	for (;;) {
+		printclusters(km);
+		if (km->nclusters >= maxclusters)
+			break;
+		splitcluster(km);
+		process(km);
+	}
+}
+
+/* start from the centers of the previous frame instead of seeding again */
+void
+reseed(struct kmeans *km)
+{
+	size_t i;
+
+	if (!(km->member = reallocarray(km->member, npoints,
+	                                sizeof(*km->member))))
+		err(1, "reallocarray");
+	for (i = 0; i < npoints; i++)
+		km->member[i] = -1;
+	for (i = 0; i < km->nclusters; i++)
+		km->clusters[i].nelems = 0;
+	free(km->iters);
+	km->iters = NULL;
+	km->niters = 0;
+	km->ndists = 0;
+	km->seeding = 0;
+}
+
+/*
+ * read farbfeld frames back to back until the end of the input and print a
+ * palette for each, the clusters of one frame seed the next
+ */
+void
+stream(uint64_t seed)
+{
+	struct kmeans km;
+	struct region req = roi;
+	size_t frame;
+	double t;
+	size_t want = nclusters;
+	int c, warm = 0;
+
+	for (frame = 0; (c = getc(stdin)) != EOF; frame++) {
+		if (c != 'f' || ungetc(c, stdin) == EOF)
+			errx(1, "frame %zu: not a farbfeld image", frame);
+		if (decay)
+			decaypoints();
+		else
+			npoints = 0;
+		roi = req;
+		parser.decodetime = 0;
+
+		t = now();
+		parseimg_ff(stdin, &parser);
+		flattenpoints(decay > 0);
+		ingesttime = now() - t;
+		reducepoints();
+
+		/* the seeding and its cap depend on the points of every frame */
+		nclusters = want;
+		initsetup();
+		if (warm && km.nclusters != nclusters)
+			warm = 0;
+		if (frame && (!warm || npoints <= nclusters))
+			freeclusters(&km);
+		if (!npoints) {
+			memset(&km, 0, sizeof(km));
+			warm = 0;
+		} else if (npoints <= nclusters) {
+			exactclusters(&km, seed);
+			warm = 0;
+		} else if (!warm) {
+			cluster(&km, seed);
+			warm = 1;
+		} else {
+			reseed(&km);
+			process(&km);
+		}
+		printclusters(&km);
+		if (bufflush(&out, STDOUT_FILENO) < 0)
+			err(1, "write");
+		if (vflag)
+			printstatistics(&km);
+	}
+}
+
+/*
+ * a request is one line of options, optionally ending with the path of the
+ * image, the image itself follows on the connection when no path is given.
+ * Errors of a request are written back on the connection, a bad request
+ * leaves the worker running while a broken image still ends it
+ */
+void
+answer(int fd, uint64_t seed)
+{
+	struct kmeans km;
+	char line[1024], *args[32], *path = NULL, *e, *s;
+	char **argv = args;
+	int argc = 0, errfd;
+	FILE *fp, *in = NULL;
+
+	if (!(fp = fdopen(fd, "r")))
+		err(1, "fdopen");
+	if ((errfd = dup(STDERR_FILENO)) < 0 ||
+	    dup2(fd, STDERR_FILENO) < 0)
+		err(1, "dup");
+	if (!fgets(line, sizeof(line), fp))
+		goto done;
+	if (!strchr(line, '\n')) {
+		warnx("request too long");
+		goto done;
+	}
+
+	args[argc++] = argv0;
+	for (e = strtok(line, " \t\n"); e && argc < LEN(args) - 1;
+	     e = strtok(NULL, " \t\n"))
+		args[argc++] = e;
+	args[argc] = NULL;
+
+	ARGBEGIN {
+	case 'e':
+		eflag = 1;
+		break;
+	case 'f':
+		if (!(s = ARGF())) {
+			warnx("missing format");
+			goto done;
+		}
+		if (setformat(s) < 0) {
+			warnx("unknown format: %s", s);
+			goto done;
+		}
+		break;
+	case 'h':
+		hflag = 1;
+		pflag = 0;
+		break;
+	case 'n':
+		if (!(s = ARGF()) || setclusters(s) < 0) {
+			warnx("invalid number");
+			goto done;
+		}
+		break;
+	case 'p':
+		pflag = 1;
+		hflag = 0;
+		break;
+	case 'r':
+		rflag = 1;
+		break;
+	case 's':
+		sflag = 1;
+		break;
+	case 'S':
+		errno = 0;
+		if ((s = ARGF()))
+			seed = strtoull(s, &e, 0);
+		if (!s || *e || errno) {
+			warnx("invalid seed");
+			goto done;
+		}
+		break;
+	default:
+		warnx("unsupported option: -%c", ARGC());
+		goto done;
+	} ARGEND;
+
+	if (argc > 1) {
+		warnx("too many arguments");
+		goto done;
+	}
+	if (argc == 1)
+		path = argv[0];
+	if (!(in = path ? fopen(path, "r") : fp)) {
+		warn("fopen %s", path);
+		goto done;
+	}
+
+	if (format->begin)
+		format->begin();
+	if (ingest(in) < 0) {
+		warnx("empty image");
+		goto done;
+	}
+	quantize(&km, seed);
+	dup2(errfd, STDERR_FILENO);
+	if (format->end)
+		format->end();
+	if (bufflush(&out, fd) < 0)
+		warn("write");
+	if (vflag)
+		printstatistics(&km);
+	freeclusters(&km);
+done:
+	dup2(errfd, STDERR_FILENO);
+	close(errfd);
+	out.len = 0;
+	if (in && in != fp)
+		fclose(in);
+	fclose(fp);
+}
+
+void
+worker(int sock, uint64_t seed)
+{
+	struct region req = roi;
+	struct format *f = format;
+	size_t n = nclusters, max = maxclusters;
+	int e = eflag, h = hflag, p = pflag, r = rflag, s = sflag;
+	int fd;
+
+	for (;;) {
+		if ((fd = accept(sock, NULL, NULL)) < 0) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			err(1, "accept");
+		}
+		/* every request starts from the options of the server */
+		roi = req;
+		format = f;
+		nclusters = n, maxclusters = max;
+		eflag = e, hflag = h, pflag = p, rflag = r, sflag = s;
+		answer(fd, seed);
+	}
+}
+
+/* listen on a unix socket, a worker that dies is replaced */
+void
+serve(const char *path, uint64_t seed)
+{
+	struct sockaddr_un sun = { .sun_family = AF_UNIX };
+	struct stat st;
+	long ncpu;
+	size_t i, nworkers;
+	int sock;
+
+	if (strlen(path) >= sizeof(sun.sun_path))
+		errx(1, "socket path too long");
+	strcpy(sun.sun_path, path);
+	if ((sock = socket(AF_UNIX, SOCK_STREAM, 0)) < 0)
+		err(1, "socket");
+	/* only ever replace a stale socket */
+	if (!lstat(path, &st) && !S_ISSOCK(st.st_mode))
+		errx(1, "%s: not a socket", path);
+	unlink(path);
+	if (bind(sock, (struct sockaddr *)&sun, sizeof(sun)) < 0)
+		err(1, "bind %s", path);
+	if (listen(sock, SOMAXCONN) < 0)
+		err(1, "listen");
+	/* a client hanging up early must not kill its worker */
+	signal(SIGPIPE, SIG_IGN);
+
+	ncpu = sysconf(_SC_NPROCESSORS_ONLN);
+	nworkers = ncpu > 0 ? ncpu : 1;
+	for (i = 0;; i++) {
+		if (i >= nworkers && wait(NULL) < 0) {
+			if (errno == EINTR)
+				continue;
+			err(1, "wait");
+		}
+		switch (fork()) {
+		case -1:
+			err(1, "fork");
+		case 0:
+			worker(sock, seed);
+		}
+	}
+}
+
+void
+usage(void)
+{
+	fprintf(stderr, "usage: %s [-abersTvw] [-h | -p] [-n clusters[-max]] "
+	        "[-R restarts] [-S seed] [-j threads] [-d] [-o file]\n"
+	        "       [-f hex | tab | json | xrdb | html | bin] "
+	        "[-t threshold] [-c geometry] [-m mask] [-C points]\n"
+	        "       [-F [-D decay] | -l socket] [file ...]\n", argv0);
+	exit(1);
+}
+
+int
+main(int argc, char *argv[])
+{
+	struct kmeans km;
+	struct region req;
+	uint64_t seed = time(NULL);
+	FILE *fp;
+	char *e;
+	size_t i, n, max;
+
+	ARGBEGIN {
+	case 'a':
+		aflag = 1;
+		break;
+	case 'b':
+		bflag = 1;
+		break;
+	case 'c':
+		parsegeometry(EARGF(usage()));
+		break;
+	case 'm':
+		maskfile = EARGF(usage());
+		break;
+	case 'w':
+		wflag = 1;
+		break;
+	case 't':
+		errno = 0;
+		alphamin = strtol(EARGF(usage()), &e, 10);
+		if (*e || errno || alphamin < 0 || alphamin > 255)
+			errx(1, "invalid alpha threshold");
+		/* fully transparent pixels never count */
+		if (!alphamin)
+			alphamin = 1;
+		break;
+	case 'd':
+		dflag = 1;
+		break;
+	case 'f':
+		if (setformat(EARGF(usage())) < 0)
+			errx(1, "unknown format: %s", argv[0]);
+		break;
+	case 'o':
+		outfile = EARGF(usage());
+		break;
+	case 'e':
+		eflag = 1;
+		break;
+	case 'F':
+		Fflag = 1;
+		break;
+	case 'j':
+		errno = 0;
+		nthreads = strtol(EARGF(usage()), &e, 10);
+		if (*e || errno || !nthreads)
+			errx(1, "invalid number");
+		break;
+	case 'l':
+		sockpath = EARGF(usage());
+		break;
+	case 'C':
+		errno = 0;
+		coresize = strtol(EARGF(usage()), &e, 10);
+		if (*e || errno || !coresize)
+			errx(1, "invalid number");
+		break;
+	case 'T':
+		parser.trusted = 1;
+		break;
+	case 'D':
+		errno = 0;
+		decay = strtol(EARGF(usage()), &e, 10);
+		if (*e || errno || decay < 0 || decay > 100)
+			errx(1, "invalid decay");
+		break;
+	case 'r':
+		rflag = 1;
+		break;
+	case 's':
+		sflag = 1;
+		break;
+	case 'v':
+		vflag = 1;
+		break;
+	case 'h':
+		hflag = 1;
+		pflag = 0;
+		break;
+	case 'p':
+		pflag = 1;
+		hflag = 0;
+		break;
+	case 'n':
+		if (setclusters(EARGF(usage())) < 0)
+			errx(1, "invalid number");
+		break;
+	case 'R':
+		errno = 0;
+		nrestarts = strtol(EARGF(usage()), &e, 10);
+		if (*e || errno || !nrestarts)
+			errx(1, "invalid number");
+		/* identical restarts would be pointless */
+		rflag = 1;
+		break;
+	case 'S':
+		errno = 0;
+		seed = strtoull(EARGF(usage()), &e, 0);
+		if (*e || errno)
+			errx(1, "invalid seed");
+		break;
+	default:
+		usage();
+	} ARGEND;
+
+	if (argc > 1 && outfile)
+		errx(1, "-o needs a single image");
+	if (argc && (Fflag || sockpath))
+		errx(1, "-F and -l don't take images as arguments");
+	if (Fflag && (maxclusters || outfile))
+		errx(1, "-F can't be combined with -o or a range of clusters");
+	if (Fflag && bflag)
+		errx(1, "-F can't be combined with -b");
+	if (bflag && nrestarts > 1)
+		errx(1, "-b can't be combined with -R");
+	/* the histogram of a stream outlives its frames, so it stays a tree */
+	if (Fflag)
+		nthreads = 1;
+	if (sockpath && (Fflag || outfile))
+		errx(1, "-l can't be combined with -F or -o");
+
+	if (maskfile)
+		loadmask(maskfile);
+	if (aflag || wflag || mask) {
+		count = countrow_weighted;
+		freqscale = (aflag ? 255 : 1) * (wflag ? 256 : 1);
+	}
+	/* opaque images go without the filler when nothing else needs it */
+	if (count == countrow && !outfile && nthreads == 1)
+		parser.rgbrow = imgrow_rgb;
+	/* a weight for each pixel needs them one by one */
+	if (!wflag && !mask && !outfile)
+		parser.idxrow = imgrow_idx;
+
+	RB_INIT(&pointhead);
+
+	if (sockpath)
+		serve(sockpath, seed);
+	if (Fflag) {
+		if (format->begin)
+			format->begin();
+		stream(seed);
+		if (format->end)
+			format->end();
+		if (bufflush(&out, STDOUT_FILENO) < 0)
+			err(1, "write");
+		return 0;
+	}
+
+	if (format->begin)
+		format->begin();
+	/* the next images are decoded while the current one is clustered */
+	req = roi;
+	n = nclusters, max = maxclusters;
+	if (argc > 1)
+		aheadstart(argv, argc);
+	for (i = 0; i < MAX(argc, 1); i++) {
+		/* every image starts from the options, not the caps of the last */
+		roi = req;
+		nclusters = n, maxclusters = max;
+		if (argc > 1) {
+			label = argv[i];
+			replay(i);
+		} else {
+			fp = argc ? openimg(argv[0]) : stdin;
+			if (ingest(fp) < 0) {
+				if (!argc)
+					return 1;
+				errx(1, "%s: empty image", argv[0]);
+			}
+			if (fp != stdin)
+				fclose(fp);
+		}
+		quantize(&km, seed);
+		if (i + 1 >= argc && format->end)
+			format->end();
+		if (bufflush(&out, STDOUT_FILENO) < 0)
+			err(1, "write");
+		if (outfile) {
+			remap(&km);
+			writeimg(outfile);
+		}
+		if (vflag)
+			printstatistics(&km);
+		freeclusters(&km);
+	}
 	return 0;
 }
@@ -1,3 +1,24 @@
 /* See LICENSE file for copyright and license details. */
-void parseimg_ff(FILE *, void (*)(int, int, int));
-void parseimg_png(FILE *, void (*)(int, int, int));
+
+/*
+ * The decoders report the image size once and then hand over the rows
+ * from y0 up to y1, top to bottom, as width 8-bit RGBA pixels. The range
+ * is the whole image unless size() narrows it. Images without alpha may
+ * come as RGB rows through rgbrow() instead, and palette images as rows
+ * of indices into pal through idxrow(), if those are set.
+ */
+struct parser {
+	void (*size)(struct parser *, uint32_t, uint32_t);
+	void (*row)(struct parser *, uint32_t, uint8_t *);
+	void (*rgbrow)(struct parser *, uint32_t, uint8_t *);
+	void (*idxrow)(struct parser *, uint32_t, uint8_t *);
+	uint8_t pal[256][4]; /* RGBA, filled in before size() */
+	uint32_t y0, y1;
+	double decodetime; /* spent in the decoder, without the callbacks */
+	int trusted; /* skip the checksums of the input */
+};
+
+void parseimg_ff(FILE *, struct parser *);
+void parseimg_png(FILE *, struct parser *);
+void writeimg_ff(FILE *, uint32_t, uint32_t, uint8_t *);
+void writeimg_png(FILE *, uint32_t, uint32_t, uint8_t *);
@@ -12,11 +12,13 @@
 #include "util.h"
 
 void
-parseimg_ff(FILE *fp, void (*fn)(int, int, int))
+parseimg_ff(FILE *fp, struct parser *pr)
 {
 	uint32_t hdr[4], width, height;
 	uint16_t *row;
+	uint8_t *out;
 	size_t rowlen, i, j;
+	double t;
 
 	if (fread(hdr, sizeof(*hdr), 4, fp) != 4)
 		err(1, "fread");
@@ -29,18 +31,56 @@ parseimg_ff(FILE *fp, void (*fn)(int, int, int))
 	if (!(row = reallocarray(NULL, width, (sizeof("RGBA") - 1) * sizeof(uint16_t))))
 		err(1, "reallocarray");
 	rowlen = width * (sizeof("RGBA") - 1);
+	if (!(out = malloc(rowlen)))
+		err(1, "malloc");
+	pr->y0 = 0;
+	pr->y1 = height;
+	pr->size(pr, width, height);
 
+	/* rows out of range are still read, to leave fp after the image */
 	for (i = 0; i < height; ++i) {
+		t = now();
 		if (fread(row, sizeof(uint16_t), rowlen, fp) != rowlen) {
 			if (ferror(fp))
 				err(1, "fread");
 			else
 				errx(1, "unexpected end of file");
 		}
-		for (j = 0; j < rowlen; j += 4) {
-			if (!row[j + 3])
-				continue;
-			fn(row[j] / 257, row[j+1] / 257, row[j+2] / 257);
+		if (i < pr->y0 || i >= pr->y1) {
+			pr->decodetime += now() - t;
+			continue;
 		}
+		for (j = 0; j < rowlen; j++)
+			out[j] = ntohs(row[j]) / 257;
+		pr->decodetime += now() - t;
+		pr->row(pr, i, out);
 	}
+	free(row);
+	free(out);
+}
+
+void
+writeimg_ff(FILE *fp, uint32_t width, uint32_t height, uint8_t *rgba)
+{
+	uint32_t hdr[4];
+	uint16_t *row;
+	size_t rowlen, i, j;
+
+	memcpy(hdr, "farbfeld", sizeof("farbfeld") - 1);
+	hdr[2] = htonl(width);
+	hdr[3] = htonl(height);
+	if (fwrite(hdr, sizeof(*hdr), 4, fp) != 4)
+		err(1, "fwrite");
+
+	if (!(row = reallocarray(NULL, width, (sizeof("RGBA") - 1) * sizeof(uint16_t))))
+		err(1, "reallocarray");
+	rowlen = width * (sizeof("RGBA") - 1);
+
+	for (i = 0; i < height; ++i, rgba += rowlen) {
+		for (j = 0; j < rowlen; j++)
+			row[j] = htons(rgba[j] * 257);
+		if (fwrite(row, sizeof(uint16_t), rowlen, fp) != rowlen)
+			err(1, "fwrite");
+	}
+	free(row);
 }
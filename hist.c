@@ -0,0 +1,100 @@
+/* See LICENSE file for copyright and license details. */
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/*
+ * A color histogram that any number of threads can add to at once. It is an
+ * open addressing table with linear probing over the packed RGB value: a
+ * free slot is claimed with a compare and swap of its key, counts are added
+ * atomically. Keys are stored off by one so that 0 means free, and the table
+ * never grows, so it is sized for every color that can show up. Each thread
+ * adds through a small direct mapped cache of its own first, so the runs of
+ * one color that make up backgrounds don't all hit the same shared counter.
+ */
+static size_t
+slot(struct hist *h, uint32_t key)
+{
+	return (key * 0x9e3779b97f4a7c15ull) >> 32 & (h->cap - 1);
+}
+
+void
+histinit(struct hist *h, size_t n)
+{
+	size_t cap = 64;
+
+	/* keep the load at no more than three quarters */
+	while (cap < n + n / 3 + 1)
+		cap <<= 1;
+	if (cap != h->cap) {
+		free(h->keys);
+		free(h->freqs);
+		h->cap = cap;
+		h->keys = calloc(cap, sizeof(*h->keys));
+		h->freqs = calloc(cap, sizeof(*h->freqs));
+		if (!h->keys || !h->freqs)
+			err(1, "calloc");
+		return;
+	}
+	memset(h->keys, 0, cap * sizeof(*h->keys));
+	memset(h->freqs, 0, cap * sizeof(*h->freqs));
+}
+
+void
+histfree(struct hist *h)
+{
+	free(h->keys);
+	free(h->freqs);
+	h->keys = NULL;
+	h->freqs = NULL;
+	h->cap = 0;
+}
+
+void
+histadd(struct hist *h, uint32_t key, long long w)
+{
+	uint32_t k;
+	size_t i;
+
+	for (i = slot(h, key);; i = (i + 1) & (h->cap - 1)) {
+		k = __atomic_load_n(&h->keys[i], __ATOMIC_RELAXED);
+		/* on failure k is what another thread got in first */
+		if (!k && __atomic_compare_exchange_n(&h->keys[i], &k, key + 1,
+		    0, __ATOMIC_RELAXED, __ATOMIC_RELAXED))
+			k = key + 1;
+		if (k == key + 1) {
+			__atomic_fetch_add(&h->freqs[i], w, __ATOMIC_RELAXED);
+			return;
+		}
+	}
+}
+
+void
+histcacheadd(struct hist *h, struct histcache *c, uint32_t key, long long w)
+{
+	size_t i = (key * 0x9e3779b1u) >> (32 - HISTCACHEBITS);
+
+	if (c->keys[i] == key + 1) {
+		c->freqs[i] += w;
+		return;
+	}
+	if (c->keys[i])
+		histadd(h, c->keys[i] - 1, c->freqs[i]);
+	c->keys[i] = key + 1;
+	c->freqs[i] = w;
+}
+
+void
+histflush(struct hist *h, struct histcache *c)
+{
+	size_t i;
+
+	for (i = 0; i < 1 << HISTCACHEBITS; i++) {
+		if (c->keys[i])
+			histadd(h, c->keys[i] - 1, c->freqs[i]);
+		c->keys[i] = 0;
+	}
+}
@@ -0,0 +1,93 @@
+/* See LICENSE file for copyright and license details. */
+#include <err.h>
+#include <stdint.h>
+#include <stdlib.h>
+#include <string.h>
+
+#include "util.h"
+
+/*
+ * The RGB cube is divided into LUTCELLS^3 cells. Each cell gets the list of
+ * the palette entries that can be the nearest one to any color inside of it,
+ * which are the ones whose distance to the cell is not larger than the
+ * smallest distance to the far corner of the cell from any entry. The lists
+ * are built the first time a cell is used and keep the entries in index
+ * order, so a lookup picks exactly what a scan of the whole palette would:
+ * the nearest entry, the first one on ties.
+ */
+#define CELLSIZE (256 / LUTCELLS)
+
+void
+lutinit(struct lut *l, int (*pal)[3], int n)
+{
+	l->pal = pal;
+	l->n = n;
+	l->cells = calloc(LUTCELLS * LUTCELLS * LUTCELLS, sizeof(*l->cells));
+	if (!l->cells)
+		err(1, "calloc");
+}
+
+void
+lutfree(struct lut *l)
+{
+	size_t i;
+
+	for (i = 0; i < LUTCELLS * LUTCELLS * LUTCELLS; i++)
+		free(l->cells[i].idx);
+	free(l->cells);
+}
+
+static void
+cellbuild(struct lut *l, struct lutcell *c, int r, int g, int b)
+{
+	int *dmin, lo[3], hi, i, j, v, d, dmax, best = INT32_MAX;
+
+	if (!(dmin = reallocarray(NULL, l->n, sizeof(*dmin))) ||
+	    !(c->idx = reallocarray(NULL, l->n, sizeof(*c->idx))))
+		err(1, "reallocarray");
+
+	lo[0] = r * CELLSIZE, lo[1] = g * CELLSIZE, lo[2] = b * CELLSIZE;
+	for (i = 0; i < l->n; i++) {
+		dmin[i] = dmax = 0;
+		for (j = 0; j < 3; j++) {
+			v = l->pal[i][j];
+			/* distance to the nearest face and to the farthest */
+			hi = lo[j] + CELLSIZE - 1;
+			d = v < lo[j] ? lo[j] - v : v > hi ? v - hi : 0;
+			dmin[i] += d * d;
+			d = v - lo[j] > hi - v ? v - lo[j] : hi - v;
+			dmax += d * d;
+		}
+		if (dmax < best)
+			best = dmax;
+	}
+	for (i = 0, c->n = 0; i < l->n; i++)
+		if (dmin[i] <= best)
+			c->idx[c->n++] = i;
+	if (!(c->idx = reallocarray(c->idx, c->n, sizeof(*c->idx))))
+		err(1, "reallocarray");
+	free(dmin);
+}
+
+int
+lutnearest(struct lut *l, int rgb[3])
+{
+	int r = rgb[0] / CELLSIZE, g = rgb[1] / CELLSIZE, b = rgb[2] / CELLSIZE;
+	struct lutcell *c = &l->cells[(r * LUTCELLS + g) * LUTCELLS + b];
+	int i, *p, d, dx, dy, dz, mind = INT32_MAX, mini = 0;
+
+	if (!c->idx)
+		cellbuild(l, c, r, g, b);
+	for (i = 0; i < c->n; i++) {
+		p = l->pal[c->idx[i]];
+		dx = rgb[0] - p[0];
+		dy = rgb[1] - p[1];
+		dz = rgb[2] - p[2];
+		d = dx * dx + dy * dy + dz * dz;
+		if (d < mind) {
+			mind = d;
+			mini = c->idx[i];
+		}
+	}
+	return mini;
+}
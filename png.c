@@ -1,18 +1,32 @@
 /* See LICENSE file for copyright and license details. */
 #include <err.h>
+#include <stdint.h>
 #include <stdio.h>
+#include <stdlib.h>
 
 #include <png.h>
 #include "colors.h"
+#include "util.h"
 
+/*
+ * rows are decoded one at a time and decoding stops after the last one
+ * that was asked for, interlaced images have to be read whole. Images
+ * without any transparency skip the filler when the caller takes RGB,
+ * palette images are not expanded at all when it takes indices.
+ */
 void
-parseimg_png(FILE *fp, void (*fn)(int, int, int))
+parseimg_png(FILE *fp, struct parser *pr)
 {
 	png_structp png_struct_p;
 	png_infop png_info_p;
-	png_bytepp png_row_p;
-	png_uint_32 y, x, width, height;
-	int depth, color, interlace;
+	png_bytepp png_row_p = NULL;
+	png_bytep row = NULL;
+	png_colorp plte;
+	png_bytep trns;
+	png_uint_32 y, width, height;
+	void (*rowfn)(struct parser *, uint32_t, uint8_t *) = pr->row;
+	int type, passes, bpp = 4, i, nplte, ntrns = 0;
+	double t = now();
 
 	png_struct_p = png_create_read_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
 	png_info_p = png_create_info_struct(png_struct_p);
@@ -20,24 +34,100 @@ parseimg_png(FILE *fp, void (*fn)(int, int, int))
 		errx(1, "failed to initialize libpng");
 
 	png_init_io(png_struct_p, fp);
-	png_set_add_alpha(png_struct_p, 255, PNG_FILLER_AFTER);
-	png_set_gray_to_rgb(png_struct_p);
-	png_read_png(png_struct_p, png_info_p, PNG_TRANSFORM_STRIP_16 |
-	             PNG_TRANSFORM_PACKING | PNG_TRANSFORM_EXPAND, NULL);
-	png_get_IHDR(png_struct_p, png_info_p, &width, &height, &depth,
-	             &color, &interlace, NULL, NULL);
-	png_row_p = png_get_rows(png_struct_p, png_info_p);
-
-	for (y = 0; y < height; y++) {
-		png_byte *row = png_row_p[y];
-		for (x = 0; x < width; x++) {
-			png_byte *p = &row[x * 4];
-			if (color == PNG_COLOR_TYPE_RGB_ALPHA && !p[3])
-				continue;
-			fn(p[0], p[1], p[2]);
+	if (pr->trusted) {
+		png_set_crc_action(png_struct_p, PNG_CRC_QUIET_USE,
+		                   PNG_CRC_QUIET_USE);
+#ifdef PNG_IGNORE_ADLER32
+		png_set_option(png_struct_p, PNG_IGNORE_ADLER32,
+		               PNG_OPTION_ON);
+#endif
+	}
+	png_read_info(png_struct_p, png_info_p);
+	png_set_strip_16(png_struct_p);
+	png_set_packing(png_struct_p);
+	type = png_get_color_type(png_struct_p, png_info_p);
+	if (type == PNG_COLOR_TYPE_PALETTE && pr->idxrow &&
+	    png_get_PLTE(png_struct_p, png_info_p, &plte, &nplte)) {
+		png_get_tRNS(png_struct_p, png_info_p, &trns, &ntrns, NULL);
+		/* indices past the palette come out black, as when expanded */
+		for (i = 0; i < 256; i++) {
+			pr->pal[i][0] = i < nplte ? plte[i].red : 0;
+			pr->pal[i][1] = i < nplte ? plte[i].green : 0;
+			pr->pal[i][2] = i < nplte ? plte[i].blue : 0;
+			pr->pal[i][3] = i < ntrns ? trns[i] : 255;
+		}
+		rowfn = pr->idxrow;
+		bpp = 1;
+	} else if (pr->rgbrow && !(type & PNG_COLOR_MASK_ALPHA) &&
+	    !png_get_valid(png_struct_p, png_info_p, PNG_INFO_tRNS)) {
+		png_set_expand(png_struct_p);
+		png_set_gray_to_rgb(png_struct_p);
+		rowfn = pr->rgbrow;
+		bpp = 3;
+	} else {
+		png_set_expand(png_struct_p);
+		png_set_add_alpha(png_struct_p, 255, PNG_FILLER_AFTER);
+		png_set_gray_to_rgb(png_struct_p);
+	}
+	passes = png_set_interlace_handling(png_struct_p);
+	png_read_update_info(png_struct_p, png_info_p);
+	width = png_get_image_width(png_struct_p, png_info_p);
+	height = png_get_image_height(png_struct_p, png_info_p);
+	pr->decodetime += now() - t;
+
+	pr->y0 = 0;
+	pr->y1 = height;
+	pr->size(pr, width, height);
+
+	if (passes > 1) {
+		t = now();
+		if (!(png_row_p = reallocarray(NULL, height, sizeof(*png_row_p))))
+			err(1, "reallocarray");
+		for (y = 0; y < height; y++)
+			if (!(png_row_p[y] = reallocarray(NULL, width, bpp)))
+				err(1, "reallocarray");
+		png_read_image(png_struct_p, png_row_p);
+		pr->decodetime += now() - t;
+		for (y = pr->y0; y < pr->y1; y++)
+			rowfn(pr, y, png_row_p[y]);
+		for (y = 0; y < height; y++)
+			free(png_row_p[y]);
+		free(png_row_p);
+	} else {
+		if (!(row = reallocarray(NULL, width, bpp)))
+			err(1, "reallocarray");
+		for (y = 0; y < pr->y1; y++) {
+			t = now();
+			png_read_row(png_struct_p, row, NULL);
+			pr->decodetime += now() - t;
+			if (y >= pr->y0)
+				rowfn(pr, y, row);
 		}
+		free(row);
 	}
 
-	png_free_data(png_struct_p, png_info_p, PNG_FREE_ALL, -1);
 	png_destroy_read_struct(&png_struct_p, &png_info_p, NULL);
 }
+
+void
+writeimg_png(FILE *fp, uint32_t width, uint32_t height, uint8_t *rgba)
+{
+	png_structp png_struct_p;
+	png_infop png_info_p;
+	png_uint_32 y;
+
+	png_struct_p = png_create_write_struct(PNG_LIBPNG_VER_STRING, NULL, NULL, NULL);
+	png_info_p = png_create_info_struct(png_struct_p);
+	if (!png_struct_p || !png_info_p || setjmp(png_jmpbuf(png_struct_p)))
+		errx(1, "failed to initialize libpng");
+
+	png_init_io(png_struct_p, fp);
+	png_set_IHDR(png_struct_p, png_info_p, width, height, 8,
+	             PNG_COLOR_TYPE_RGB_ALPHA, PNG_INTERLACE_NONE,
+	             PNG_COMPRESSION_TYPE_BASE, PNG_FILTER_TYPE_BASE);
+	png_write_info(png_struct_p, png_info_p);
+	for (y = 0; y < height; y++)
+		png_write_row(png_struct_p, &rgba[(size_t)y * width * 4]);
+	png_write_end(png_struct_p, NULL);
+	png_destroy_write_struct(&png_struct_p, &png_info_p);
+}
@@ -16,9 +16,17 @@
  */
 
 #include <sys/types.h>
+#include <err.h>
 #include <errno.h>
+#include <stdarg.h>
 #include <stdint.h>
+#include <stdio.h>
 #include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "util.h"
 
 /*
  * This is sqrt(SIZE_MAX+1), as s1*s2 <= SIZE_MAX
@@ -36,3 +44,72 @@ reallocarray(void *optr, size_t nmemb, size_t size)
 	}
 	return realloc(optr, size * nmemb);
 }
+
+/* seconds on the monotonic clock */
+double
+now(void)
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void
+bufgrow(struct buf *b, size_t n)
+{
+	if (b->len + n < b->cap)
+		return;
+	while (b->len + n >= b->cap)
+		b->cap = b->cap ? b->cap * 2 : 65536;
+	if (!(b->data = realloc(b->data, b->cap)))
+		err(1, "realloc");
+}
+
+void
+bufwrite(struct buf *b, const void *p, size_t n)
+{
+	bufgrow(b, n);
+	memcpy(b->data + b->len, p, n);
+	b->len += n;
+}
+
+void
+bufprintf(struct buf *b, const char *fmt, ...)
+{
+	va_list ap;
+	int n;
+
+	for (;;) {
+		va_start(ap, fmt);
+		n = vsnprintf(b->data + b->len, b->cap - b->len, fmt, ap);
+		va_end(ap);
+		if (n < 0)
+			err(1, "vsnprintf");
+		if (b->len + n < b->cap)
+			break;
+		bufgrow(b, n);
+	}
+	b->len += n;
+}
+
+/* write out everything that was buffered with as few syscalls as possible */
+int
+bufflush(struct buf *b, int fd)
+{
+	size_t off;
+	ssize_t n;
+
+	for (off = 0; off < b->len; off += n) {
+		n = write(fd, b->data + off, b->len - off);
+		if (n < 0) {
+			if (errno == EINTR) {
+				n = 0;
+				continue;
+			}
+			return -1;
+		}
+	}
+	b->len = 0;
+	return 0;
+}
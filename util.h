@@ -1,3 +1,57 @@
 /* See LICENSE file for copyright and license details. */
+struct rng {
+	uint64_t s[4];
+};
+
+/* output buffer, written out at once by bufflush() */
+struct buf {
+	char *data;
+	size_t len;
+	size_t cap;
+};
+
+/* nearest palette entry lookup, see lut.c */
+#define LUTCELLS 32
+
+struct lutcell {
+	int *idx; /* NULL until the cell is built */
+	int n;
+};
+
+struct lut {
+	int (*pal)[3];
+	int n;
+	struct lutcell *cells;
+};
+
+/* histogram that threads add to concurrently, see hist.c */
+#define HISTCACHEBITS 6
+
+struct hist {
+	uint32_t *keys; /* RGB + 1, 0 if the slot is free */
+	long long *freqs;
+	size_t cap;
+};
+
+struct histcache {
+	uint32_t keys[1 << HISTCACHEBITS];
+	long long freqs[1 << HISTCACHEBITS];
+};
+
 #undef reallocarray
 void *reallocarray(void *, size_t, size_t);
+double now(void);
+void bufwrite(struct buf *, const void *, size_t);
+void bufprintf(struct buf *, const char *, ...);
+int bufflush(struct buf *, int);
+void rngseed(struct rng *, uint64_t);
+uint64_t rngnext(struct rng *);
+uint64_t rnguniform(struct rng *, uint64_t);
+void lutinit(struct lut *, int (*)[3], int);
+void lutfree(struct lut *);
+int lutnearest(struct lut *, int [3]);
+void histinit(struct hist *, size_t);
+void histfree(struct hist *);
+void histadd(struct hist *, uint32_t, long long);
+void histcacheadd(struct hist *, struct histcache *, uint32_t, long long);
+void histflush(struct hist *, struct histcache *);